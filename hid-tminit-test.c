@@ -0,0 +1,254 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests of the decoding of the answer to the model request and of the
+ * lookup of the wheels, with a benchmark of the lookup on a large table.
+ *
+ * Built only with CONFIG_HID_TMINIT_KUNIT_TEST, included at the end of
+ * hid-tminit.c to reach its static functions. The tests run when the test
+ * module is loaded, before any wheel has been added at runtime.
+ */
+#include <kunit/test.h>
+
+#if !IS_ENABLED(CONFIG_KUNIT)
+#error "CONFIG_HID_TMINIT_KUNIT_TEST needs a kernel with CONFIG_KUNIT"
+#endif
+
+static unsigned int bench_lookups;
+module_param(bench_lookups, uint, 0444);
+MODULE_PARM_DESC(bench_lookups, "Lookups timed by the tm_test_bench_lookup test case, 0 skips it (default 0)");
+
+static struct device tm_test_dev = {
+	.init_name = "hid-tminit-test",
+};
+
+/*
+ * The answers of the table in README.md, as sent on the wire
+ */
+static const struct {
+	const char *name;
+	u8 bytes[sizeof(struct tm_wheel_response)];
+	unsigned int length;
+	uint8_t model;
+	uint8_t attachment;
+	// NULL if the model is not known
+	const char *wheel_name;
+} tm_test_responses[] = {
+	{ "T150", { 0x49, 0x00, 0x21, 0x00, 0x00, 0x00, 0x06, 0x03 }, 16,
+	  0x03, 0x06, "Thrustmaster T150RS" },
+	{ "T300 (@Kimplul)", { 0x49, 0x00, 0x03, 0x01, 0x01, 0x00, 0x06, 0x02,
+			       0x13, 0x00, 0x00, 0x00, 0x05, 0x01, 0x00, 0x00 }, 16,
+	  0x02, 0x06, "Thrustmaster T300RS" },
+	{ "T300 (cap from Gitlab)", { 0x49, 0x00, 0x21, 0x00, 0x00, 0x00, 0x06, 0x02 }, 16,
+	  0x02, 0x06, "Thrustmaster T300RS" },
+	{ "T300 Ferrari Alcantara Edition", { 0x49, 0x00, 0x02, 0x00, 0x01, 0x00, 0x04, 0x02,
+					      0x13, 0x00, 0x00, 0x00, 0x05, 0x01, 0x00, 0x00 }, 16,
+	  0x02, 0x04, "Thrustmaster T300 Ferrari Alcantara Edition" },
+	{ "TMX", { 0x47, 0x00, 0x41, 0x00, 0x00, 0x00, 0x07, 0x04 }, 8,
+	  0x04, 0x07, NULL },
+	{ "T500", { 0x47, 0x00, 0x03, 0x00, 0x00, 0x00, 0x02, 0x00 }, 8,
+	  0x00, 0x02, "Thrustmaster T500RS" },
+};
+
+#define TM_TEST_T150 0
+#define TM_TEST_T500 5
+
+static int tm_test_parse(const u8 *bytes, unsigned int length, uint8_t *model, uint8_t *attachment)
+{
+	return thrustmaster_parse_response(&tm_test_dev, (const struct tm_wheel_response *)bytes,
+					   length, model, attachment);
+}
+
+// Every answer of README.md is decoded and looked up
+static void tm_test_readme_responses(struct kunit *test)
+{
+	const struct tm_wheel_info *twi;
+	uint8_t model, attachment;
+	bool attachment_found;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(tm_test_responses); i++) {
+		ret = tm_test_parse(tm_test_responses[i].bytes, tm_test_responses[i].length,
+				    &model, &attachment);
+		KUNIT_EXPECT_EQ_MSG(test, ret, 0, "%s", tm_test_responses[i].name);
+		if (ret)
+			continue;
+
+		KUNIT_EXPECT_EQ_MSG(test, model, tm_test_responses[i].model, "%s", tm_test_responses[i].name);
+		KUNIT_EXPECT_EQ_MSG(test, attachment, tm_test_responses[i].attachment, "%s",
+				    tm_test_responses[i].name);
+
+		twi = thrustmaster_find_wheel(model, attachment, &attachment_found);
+		if (!tm_test_responses[i].wheel_name) {
+			KUNIT_EXPECT_TRUE_MSG(test, !twi, "%s", tm_test_responses[i].name);
+			continue;
+		}
+
+		KUNIT_EXPECT_TRUE_MSG(test, twi != NULL, "%s", tm_test_responses[i].name);
+		if (!twi)
+			continue;
+		KUNIT_EXPECT_TRUE_MSG(test, attachment_found, "%s", tm_test_responses[i].name);
+		KUNIT_EXPECT_STREQ(test, twi->wheel_name, tm_test_responses[i].wheel_name);
+	}
+}
+
+// Answers that can't be decoded leave model and attachment untouched
+static void tm_test_malformed_responses(struct kunit *test)
+{
+	static const u8 unknown_type[sizeof(struct tm_wheel_response)] = {
+		0x50, 0x00, 0x21, 0x00, 0x00, 0x00, 0x06, 0x03
+	};
+	// 0x4900 once read as little endian
+	static const u8 swapped_type[sizeof(struct tm_wheel_response)] = {
+		0x00, 0x49, 0x21, 0x00, 0x00, 0x00, 0x06, 0x03
+	};
+	const u8 *t150 = tm_test_responses[TM_TEST_T150].bytes;
+	const u8 *t500 = tm_test_responses[TM_TEST_T500].bytes;
+	uint8_t model = 0xff, attachment = 0xff;
+
+	// Shorter than the type
+	KUNIT_EXPECT_EQ(test, tm_test_parse(t150, 0, &model, &attachment), -EMSGSIZE);
+	KUNIT_EXPECT_EQ(test, tm_test_parse(t150, 1, &model, &attachment), -EMSGSIZE);
+
+	// Type 0x49, but shorter than its layout
+	KUNIT_EXPECT_EQ(test, tm_test_parse(t150, tm_response_formats[TM_RESPONSE_A].min_length - 1,
+					    &model, &attachment), -EMSGSIZE);
+	KUNIT_EXPECT_EQ(test, tm_test_parse(t150, 8, &model, &attachment), -EMSGSIZE);
+	KUNIT_EXPECT_EQ(test, tm_test_parse(t500, tm_response_formats[TM_RESPONSE_B].min_length - 1,
+					    &model, &attachment), -EMSGSIZE);
+
+	KUNIT_EXPECT_EQ(test, tm_test_parse(unknown_type, sizeof(unknown_type), &model, &attachment),
+			-ENODATA);
+	KUNIT_EXPECT_EQ(test, tm_test_parse(swapped_type, sizeof(swapped_type), &model, &attachment),
+			-ENODATA);
+
+	KUNIT_EXPECT_EQ(test, model, (uint8_t)0xff);
+	KUNIT_EXPECT_EQ(test, attachment, (uint8_t)0xff);
+
+	// Once long enough, the same answers are decoded
+	KUNIT_EXPECT_EQ(test, tm_test_parse(t150, 16, &model, &attachment), 0);
+	KUNIT_EXPECT_EQ(test, tm_test_parse(t500, 8, &model, &attachment), 0);
+}
+
+static void tm_test_expect_wheel(struct kunit *test, uint8_t model, uint8_t attachment,
+				 const char *wheel_name, bool attachment_found)
+{
+	const struct tm_wheel_info *twi;
+	bool found;
+
+	twi = thrustmaster_find_wheel(model, attachment, &found);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, twi);
+	KUNIT_EXPECT_STREQ(test, twi->wheel_name, wheel_name);
+	KUNIT_EXPECT_EQ_MSG(test, found, attachment_found, "(0x%02x, 0x%02x)", model, attachment);
+}
+
+static void tm_test_find_wheel(struct kunit *test)
+{
+	bool found;
+
+	// Exact matches, the first and the last entries included
+	tm_test_expect_wheel(test, 0x00, 0x02, "Thrustmaster T500RS", true);
+	tm_test_expect_wheel(test, 0x02, 0x03, "Thrustmaster T300RS (F1 attachment)", true);
+	tm_test_expect_wheel(test, 0x03, 0x06, "Thrustmaster T150RS", true);
+
+	// Unknown attachments fall back to the lowest attachment of the model
+	tm_test_expect_wheel(test, 0x00, 0x00, "Thrustmaster T500RS", false);
+	tm_test_expect_wheel(test, 0x00, 0x05, "Thrustmaster T500RS", false);
+	tm_test_expect_wheel(test, 0x02, 0x05, "Thrustmaster T300RS (Missing Attachment)", false);
+	tm_test_expect_wheel(test, 0x02, 0xff, "Thrustmaster T300RS (Missing Attachment)", false);
+	tm_test_expect_wheel(test, 0x03, 0x00, "Thrustmaster T150RS", false);
+	tm_test_expect_wheel(test, 0x03, 0xff, "Thrustmaster T150RS", false);
+
+	// Unknown models, between the known ones and after the last one
+	KUNIT_EXPECT_TRUE(test, !thrustmaster_find_wheel(0x01, 0x00, &found));
+	KUNIT_EXPECT_FALSE(test, found);
+	KUNIT_EXPECT_TRUE(test, !thrustmaster_find_wheel(0x04, 0x07, &found));
+	KUNIT_EXPECT_TRUE(test, !thrustmaster_find_wheel(0xff, 0xff, &found));
+}
+
+/*
+ * Builds a table of count wheels: every even model with the even attachments
+ * from 0 up. Returns NULL if it can't be allocated.
+ */
+static struct tm_wheel_db *tm_test_db_alloc(struct kunit *test, unsigned int count)
+{
+	struct tm_wheel_info *infos;
+	struct tm_wheel_db *db;
+	unsigned int i, per_model = count / 128;
+
+	infos = kunit_kcalloc(test, count, sizeof(*infos), GFP_KERNEL);
+	db = kunit_kzalloc(test, struct_size(db, infos, count), GFP_KERNEL);
+	if (!infos || !db)
+		return NULL;
+
+	for (i = 0; i < count; i++) {
+		infos[i].model = 2 * (i / per_model);
+		infos[i].attachment = 2 * (i % per_model);
+		infos[i].wheel_name = "synthetic";
+		db->infos[i] = infos + i;
+	}
+	db->count = count;
+
+	return db;
+}
+
+#define TM_TEST_BENCH_WHEELS 4096
+
+/*
+ * Times bench_lookups lookups of random wheels in a table much larger than
+ * tm_wheels_infos[], a quarter of them exact matches, a quarter fallbacks and
+ * half unknown models
+ */
+static void tm_test_bench_lookup(struct kunit *test)
+{
+	unsigned int per_model = TM_TEST_BENCH_WHEELS / 128;
+	const struct tm_wheel_info *twi;
+	struct tm_wheel_db *db;
+	unsigned int i, errors = 0;
+	uint8_t model, attachment;
+	u32 seed = 1;
+	bool found;
+	ktime_t start;
+	s64 elapsed;
+
+	if (!bench_lookups)
+		kunit_skip(test, "bench_lookups is 0");
+
+	db = tm_test_db_alloc(test, TM_TEST_BENCH_WHEELS);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, db);
+
+	start = ktime_get();
+	for (i = 0; i < bench_lookups; i++) {
+		seed = seed * 1664525 + 1013904223;
+		model = seed >> 24;
+		attachment = (seed >> 16) % (2 * per_model);
+
+		twi = thrustmaster_db_find(db, model, attachment, &found);
+		if (model % 2)
+			errors += twi != NULL;
+		else
+			errors += !twi || twi->model != model ||
+				  found != !(attachment % 2) ||
+				  twi->attachment != (found ? attachment : 0);
+	}
+	elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	KUNIT_EXPECT_EQ(test, errors, 0U);
+	kunit_info(test, "%u lookups in %u wheels: %lld ns, %lld ns per lookup\n",
+		   bench_lookups, TM_TEST_BENCH_WHEELS, elapsed, div_s64(elapsed, bench_lookups));
+}
+
+static struct kunit_case tm_test_cases[] = {
+	KUNIT_CASE(tm_test_readme_responses),
+	KUNIT_CASE(tm_test_malformed_responses),
+	KUNIT_CASE(tm_test_find_wheel),
+	KUNIT_CASE(tm_test_bench_lookup),
+	{}
+};
+
+static struct kunit_suite tm_test_suite = {
+	.name = "hid_tminit",
+	.test_cases = tm_test_cases,
+};
+
+kunit_test_suite(tm_test_suite);
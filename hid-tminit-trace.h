@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints of the initialization of the Thrustmaster wheels, see
+ * hid-tminit.c. They can be enabled from /sys/kernel/tracing/events/hid_tminit
+ * or used with perf and bpftrace.
+ *
+ * The wheel is identified by the id of its hid device, the last field
+ * of its name (e.g. 0003:044F:B65D.000A is 0x000a).
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hid_tminit
+
+#if !defined(_HID_TMINIT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HID_TMINIT_TRACE_H
+
+#include <linux/hid.h>
+#include <linux/usb.h>
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(tminit_submit,
+	TP_PROTO(struct hid_device *hdev, unsigned int step),
+	TP_ARGS(hdev, step),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(unsigned int, step)
+	),
+
+	TP_fast_assign(
+		__entry->id = hdev->id;
+		__entry->step = step;
+	),
+
+	TP_printk("dev=%04x step=%u", __entry->id, __entry->step)
+);
+
+DECLARE_EVENT_CLASS(tminit_complete,
+	TP_PROTO(struct hid_device *hdev, unsigned int step, struct urb *urb),
+	TP_ARGS(hdev, step, urb),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(unsigned int, step)
+		__field(int, status)
+		__field(u32, actual_length)
+	),
+
+	TP_fast_assign(
+		__entry->id = hdev->id;
+		__entry->step = step;
+		__entry->status = urb->status;
+		__entry->actual_length = urb->actual_length;
+	),
+
+	TP_printk("dev=%04x step=%u status=%d actual_length=%u",
+		  __entry->id, __entry->step, __entry->status, __entry->actual_length)
+);
+
+DEFINE_EVENT(tminit_submit, tminit_setup_submit,
+	TP_PROTO(struct hid_device *hdev, unsigned int step),
+	TP_ARGS(hdev, step)
+);
+
+DEFINE_EVENT(tminit_complete, tminit_setup_complete,
+	TP_PROTO(struct hid_device *hdev, unsigned int step, struct urb *urb),
+	TP_ARGS(hdev, step, urb)
+);
+
+DEFINE_EVENT(tminit_submit, tminit_model_submit,
+	TP_PROTO(struct hid_device *hdev, unsigned int step),
+	TP_ARGS(hdev, step)
+);
+
+DEFINE_EVENT(tminit_complete, tminit_model_complete,
+	TP_PROTO(struct hid_device *hdev, unsigned int step, struct urb *urb),
+	TP_ARGS(hdev, step, urb)
+);
+
+DEFINE_EVENT(tminit_submit, tminit_switch_submit,
+	TP_PROTO(struct hid_device *hdev, unsigned int step),
+	TP_ARGS(hdev, step)
+);
+
+DEFINE_EVENT(tminit_complete, tminit_switch_complete,
+	TP_PROTO(struct hid_device *hdev, unsigned int step, struct urb *urb),
+	TP_ARGS(hdev, step, urb)
+);
+
+/*
+ * The wheel moved from phase old to phase new, after having spent
+ * elapsed_ns in old (retries included)
+ */
+TRACE_EVENT(tminit_state,
+	TP_PROTO(struct hid_device *hdev, int old, int new, s64 elapsed_ns),
+	TP_ARGS(hdev, old, new, elapsed_ns),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(int, old)
+		__field(int, new)
+		__field(s64, elapsed_ns)
+	),
+
+	TP_fast_assign(
+		__entry->id = hdev->id;
+		__entry->old = old;
+		__entry->new = new;
+		__entry->elapsed_ns = elapsed_ns;
+	),
+
+	TP_printk("dev=%04x %d -> %d elapsed_ns=%lld",
+		  __entry->id, __entry->old, __entry->new, __entry->elapsed_ns)
+);
+
+#endif /* _HID_TMINIT_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-tminit-trace
+#include <trace/define_trace.h>
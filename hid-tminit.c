@@ -13,11 +13,120 @@
  * Copyright (c) 2020-2021 Dario Pagani <dario.pagani.146+linuxk@gmail.com>
  * Copyright (c) 2020-2021 Kim Kuparinen <kimi.h.kuparinen@gmail.com>
  */
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
 #include <linux/hid.h>
 #include <linux/usb.h>
 #include <linux/input.h>
 #include <linux/slab.h>
 #include <linux/module.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+#include <linux/mutex.h>
+#include <linux/ratelimit.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+
+#define CREATE_TRACE_POINTS
+#include "hid-tminit-trace.h"
+#include "hid-tminit.h"
+
+static unsigned int max_retries = 5;
+module_param(max_retries, uint, 0644);
+MODULE_PARM_DESC(max_retries, "How many times a failed model query or mode switch is retried (default 5)");
+
+static unsigned int retry_delay_ms = 20;
+module_param(retry_delay_ms, uint, 0644);
+MODULE_PARM_DESC(retry_delay_ms, "Delay in ms before the first retry, doubled at each further one (default 20)");
+
+static unsigned int retry_delay_max_ms = 1000;
+module_param(retry_delay_max_ms, uint, 0644);
+MODULE_PARM_DESC(retry_delay_max_ms, "Upper bound in ms of the delay between two retries (default 1000)");
+
+static unsigned int max_inflight;
+module_param(max_inflight, uint, 0644);
+MODULE_PARM_DESC(max_inflight, "How many wheels may be initialized at the same time, 0 for no limit (default 0)");
+
+static int setup_interrupts = -1;
+module_param(setup_interrupts, int, 0644);
+MODULE_PARM_DESC(setup_interrupts, "Send the T300RS setup interrupts: -1 only to wheels needing them, after the model query (default), 0 never, 1 to every wheel before the model query");
+
+/*
+ * Defaults of the pacing of the init, each wheel has its own copy in sysfs
+ */
+static unsigned int setup_timeout_ms = 5000;
+module_param(setup_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(setup_timeout_ms, "Timeout in ms of each setup interrupt, 0 for none (default 5000)");
+
+static unsigned int query_timeout_ms = 5000;
+module_param(query_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(query_timeout_ms, "Timeout in ms of the model query, 0 for none (default 5000)");
+
+static unsigned int switch_timeout_ms = 5000;
+module_param(switch_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(switch_timeout_ms, "Timeout in ms of each switch step, 0 for none (default 5000)");
+
+static unsigned int phase_gap_ms;
+module_param(phase_gap_ms, uint, 0644);
+MODULE_PARM_DESC(phase_gap_ms, "Pause in ms after the setup interrupts and after the model query (default 0)");
+
+static bool fast_input;
+module_param(fast_input, bool, 0444);
+MODULE_PARM_DESC(fast_input, "Report the input of the generic wheel through a minimal input device fed by raw_event instead of hid-input, if every field of its input report can be decoded (default N)");
+
+static int quiet_probe = -1;
+module_param(quiet_probe, int, 0644);
+MODULE_PARM_DESC(quiet_probe, "Don't create the input and hidraw nodes of the generic wheel, that goes away once switched: -1 only for wheels in model_cache (default), 0 never, 1 always. They are created if the init fails");
+
+static unsigned int identity_ttl_ms = 30000;
+module_param(identity_ttl_ms, uint, 0644);
+MODULE_PARM_DESC(identity_ttl_ms, "For how long in ms after the switch tminit_get_identity() reports what has been detected on a wheel (default 30000)");
+
+static char *priorities;
+module_param(priorities, charp, 0444);
+MODULE_PARM_DESC(priorities, "Init priority of known wheels, as key:priority[,...] with key as in model_cache. Waiting wheels with a higher priority get an init slot first (default 0)");
+
+static unsigned int bench_iterations;
+module_param(bench_iterations, uint, 0644);
+MODULE_PARM_DESC(bench_iterations, "Times the setup interrupts and the model request are timed on each wheel before its init, results in debugfs hid-tminit/ (default 0, at most 1000)");
+#define TM_BENCH_MAX_ITERATIONS 1000
+
+static char *model_cache;
+module_param(model_cache, charp, 0444);
+MODULE_PARM_DESC(model_cache, "Wheels known in advance, as key:model:attachment[,...] where key is the USB serial number or port path (e.g. 1-1.2)");
+
+static bool debug;
+module_param(debug, bool, 0644);
+MODULE_PARM_DESC(debug, "Log every step of the init, not only the errors (default N)");
+
+/*
+ * Most messages are printed on every attempt of every wheel, with many
+ * wheels that is a lot of console output. The routine ones are only printed if debug is set or
+ * through dynamic debug, the errors are rate limited.
+ */
+#define tm_dbg(hdev, fmt, ...)						\
+do {									\
+	if (debug)							\
+		hid_info(hdev, fmt, ##__VA_ARGS__);			\
+	else								\
+		hid_dbg(hdev, fmt, ##__VA_ARGS__);			\
+} while (0)
+#define tm_err_ratelimited(hdev, fmt, ...) \
+	dev_err_ratelimited(&(hdev)->dev, fmt, ##__VA_ARGS__)
+#define tm_warn_ratelimited(hdev, fmt, ...) \
+	dev_warn_ratelimited(&(hdev)->dev, fmt, ##__VA_ARGS__)
+
+/*
+ * The init of every wheel runs on this workqueue, so that wheels connected
+ * together are initialized concurrently. At most max_inflight of them are
+ * initialized at once, the others wait in tm_pending sorted by priority.
+ */
+static struct workqueue_struct *tm_wq;
+static DEFINE_SPINLOCK(tm_inflight_lock);
+static LIST_HEAD(tm_pending);
+static unsigned int tm_inflight;
 
 /*
  * These interrupts are used to prevent a nasty crash when initializing the
@@ -29,6 +138,8 @@ static const u8 setup_2[] = { 0x0a, 0x04, 0x00, 0x0c, 0x00, 0x00, 0x00, 0x00 };
 static const u8 setup_3[] = { 0x0a, 0x04, 0x12, 0x10, 0x00, 0x00, 0x00, 0x00 };
 static const u8 setup_4[] = { 0x0a, 0x04, 0x00, 0x06, 0x00, 0x00, 0x00, 0x00 };
 static const u8 *const setup_arr[] = { setup_0, setup_1, setup_2, setup_3, setup_4 };
+// Size of the longest one of setup_arr[]
+#define TM_SETUP_MAX_SIZE ARRAY_SIZE(setup_0)
 static const unsigned int setup_arr_sizes[] = {
 	ARRAY_SIZE(setup_0),
 	ARRAY_SIZE(setup_1),
@@ -36,6 +147,47 @@ static const unsigned int setup_arr_sizes[] = {
 	ARRAY_SIZE(setup_3),
 	ARRAY_SIZE(setup_4)
 };
+
+/*
+ * A transfer sent to switch a wheel to its full capabilities.
+ * - TM_STEP_CONTROL steps send change_request with wValue = value
+ * - TM_STEP_INTERRUPT steps send data on the interrupt out endpoint, like
+ *   the setup interrupts do
+ * After the transfer the next step is sent once delay_ms have elapsed.
+ */
+enum tm_switch_step_type {
+	TM_STEP_CONTROL,
+	TM_STEP_INTERRUPT
+};
+
+// Size of the longest payload of a TM_STEP_INTERRUPT step
+#define TM_SWITCH_MAX_SIZE 16
+
+struct tm_switch_step {
+	enum tm_switch_step_type type;
+	uint16_t value;
+	const u8 *data;
+	uint8_t size;
+	unsigned int delay_ms;
+};
+
+#define TM_CONTROL_STEP(_value, _delay_ms) \
+	{ .type = TM_STEP_CONTROL, .value = (_value), .delay_ms = (_delay_ms) }
+#define TM_INTERRUPT_STEP(_data, _delay_ms) \
+	{ .type = TM_STEP_INTERRUPT, .data = (_data), .size = ARRAY_SIZE(_data), .delay_ms = (_delay_ms) }
+
+static const struct tm_switch_step tm_switch_t500rs[] = { TM_CONTROL_STEP(0x0002, 0) };
+static const struct tm_switch_step tm_switch_t300rs[] = { TM_CONTROL_STEP(0x0005, 0) };
+static const struct tm_switch_step tm_switch_t150rs[] = { TM_CONTROL_STEP(0x0006, 0) };
+static const struct tm_switch_step tm_switch_t128[] = { TM_CONTROL_STEP(0x000b, 0) };
+/*
+ * The TMX seems to require two control codes to switch, only the first one
+ * is known:
+ * static const struct tm_switch_step tm_switch_tmx[] = {
+ *	TM_CONTROL_STEP(0x0001, ?), TM_CONTROL_STEP(?, 0)
+ * };
+ */
+
 /*
  * This struct contains for each type of
  * Thrustmaster wheel
@@ -50,241 +202,2641 @@ struct tm_wheel_info {
 	uint8_t model;
 	uint8_t attachment;
 
-	/**
-	 * See when the USB control out packet is prepared...
-	 * @TODO The TMX seems to require multiple control codes to switch.
-	 */
-	uint16_t switch_value;
+	/**
+	 * The transfers to send, in order, to switch the wheel.
+	 * See thrustmaster_submit_change_request()
+	 */
+	const struct tm_switch_step *switch_steps;
+	unsigned int switch_steps_count;
+
+	char const *wheel_name;
+
+	unsigned int quirks;
+};
+
+/*
+ * The wheel needs the setup interrupts, see thrustmaster_interrupts()
+ */
+#define TM_QUIRK_SETUP_INTERRUPTS BIT(0)
+
+#define TM_STEPS(steps) (steps), ARRAY_SIZE(steps)
+
+/*
+ * Known wheels.
+ * Note: TMX does not work as the second of its control packets is unknown
+ *
+ * The entries must be sorted by (model, attachment) without duplicates,
+ * it is checked when the module is loaded. More wheels can be added at
+ * runtime, see new_wheel_store().
+ */
+static const struct tm_wheel_info tm_wheels_infos[] = {
+	{0x00, 0x02, TM_STEPS(tm_switch_t500rs), "Thrustmaster T500RS"},
+	{0x00, 0x09, TM_STEPS(tm_switch_t128), "Thrustmaster T128"},
+	{0x02, 0x00, TM_STEPS(tm_switch_t300rs), "Thrustmaster T300RS (Missing Attachment)", TM_QUIRK_SETUP_INTERRUPTS},
+	{0x02, 0x03, TM_STEPS(tm_switch_t300rs), "Thrustmaster T300RS (F1 attachment)", TM_QUIRK_SETUP_INTERRUPTS},
+	{0x02, 0x04, TM_STEPS(tm_switch_t300rs), "Thrustmaster T300 Ferrari Alcantara Edition", TM_QUIRK_SETUP_INTERRUPTS},
+	{0x02, 0x06, TM_STEPS(tm_switch_t300rs), "Thrustmaster T300RS", TM_QUIRK_SETUP_INTERRUPTS},
+	{0x02, 0x09, TM_STEPS(tm_switch_t300rs), "Thrustmaster T300RS (Open Wheel Attachment)", TM_QUIRK_SETUP_INTERRUPTS},
+	{0x03, 0x06, TM_STEPS(tm_switch_t150rs), "Thrustmaster T150RS"}
+	//{0x04, 0x07, TM_STEPS(tm_switch_tmx), "Thrustmaster TMX"}
+};
+
+static inline uint16_t tm_wheel_key(uint8_t model, uint8_t attachment)
+{
+	return (model << 8) | attachment;
+}
+
+/*
+ * The wheels that can be recognized: tm_wheels_infos[] plus the ones added
+ * at runtime, sorted by (model, attachment). Readers use RCU, so lookups
+ * don't take locks, writers replace the whole array under tm_db_lock.
+ */
+struct tm_wheel_db {
+	struct rcu_head rcu;
+	unsigned int count;
+	const struct tm_wheel_info *infos[];
+};
+
+static struct tm_wheel_db __rcu *tm_db;
+static DEFINE_MUTEX(tm_db_lock);
+
+static inline uint16_t tm_wheel_info_key(const struct tm_wheel_info *twi)
+{
+	return tm_wheel_key(twi->model, twi->attachment);
+}
+
+/*
+ * Index of the first entry of db whose (model, attachment) is not lower
+ * than key, db->count if there is none
+ */
+static unsigned int thrustmaster_lower_bound(const struct tm_wheel_db *db, uint16_t key)
+{
+	unsigned int lo = 0, hi = db->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tm_wheel_info_key(db->infos[mid]) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+// The lookup of thrustmaster_find_wheel() in db
+static const struct tm_wheel_info *thrustmaster_db_find(const struct tm_wheel_db *db, uint8_t model,
+							 uint8_t attachment, bool *attachment_found)
+{
+	unsigned int i;
+
+	i = thrustmaster_lower_bound(db, tm_wheel_key(model, attachment));
+	*attachment_found = i < db->count &&
+			    db->infos[i]->model == model &&
+			    db->infos[i]->attachment == attachment;
+	if (*attachment_found)
+		return db->infos[i];
+
+	i = thrustmaster_lower_bound(db, tm_wheel_key(model, 0));
+	if (i < db->count && db->infos[i]->model == model)
+		return db->infos[i];
+
+	return NULL;
+}
+
+/*
+ * Looks for the wheel with the given model and attachment.
+ * If the model is known but the attachment is not, the entry of that model
+ * with the lowest attachment code is used as fallback.
+ * Returns NULL if the model is unknown, *attachment_found tells whether the
+ * attachment matched. Safe to call from atomic context.
+ *
+ * The entries are never freed while the module is loaded, the pointer stays
+ * valid after the lookup.
+ */
+static const struct tm_wheel_info *thrustmaster_find_wheel(uint8_t model, uint8_t attachment, bool *attachment_found)
+{
+	const struct tm_wheel_info *twi;
+
+	rcu_read_lock();
+	twi = thrustmaster_db_find(rcu_dereference(tm_db), model, attachment, attachment_found);
+	rcu_read_unlock();
+
+	return twi;
+}
+
+/*
+ * Adds twi to tm_db, replacing the entry with the same model and attachment
+ * if there is one
+ */
+static int thrustmaster_db_insert(const struct tm_wheel_info *twi)
+{
+	struct tm_wheel_db *old, *db;
+	unsigned int i, count = 0;
+	uint16_t key = tm_wheel_info_key(twi);
+	bool inserted = false;
+
+	mutex_lock(&tm_db_lock);
+	old = rcu_dereference_protected(tm_db, lockdep_is_held(&tm_db_lock));
+
+	db = kmalloc(struct_size(db, infos, (old ? old->count : 0) + 1), GFP_KERNEL);
+	if (!db) {
+		mutex_unlock(&tm_db_lock);
+		return -ENOMEM;
+	}
+
+	for (i = 0; old && i < old->count; i++) {
+		if (!inserted && tm_wheel_info_key(old->infos[i]) >= key) {
+			db->infos[count++] = twi;
+			inserted = true;
+			if (tm_wheel_info_key(old->infos[i]) == key)
+				continue;
+		}
+		db->infos[count++] = old->infos[i];
+	}
+	if (!inserted)
+		db->infos[count++] = twi;
+	db->count = count;
+
+	rcu_assign_pointer(tm_db, db);
+	mutex_unlock(&tm_db_lock);
+
+	if (old)
+		kfree_rcu(old, rcu);
+
+	return 0;
+}
+
+static bool thrustmaster_wheels_sorted(void)
+{
+	unsigned int i;
+
+	for (i = 1; i < ARRAY_SIZE(tm_wheels_infos); i++)
+		if (tm_wheel_key(tm_wheels_infos[i - 1].model, tm_wheels_infos[i - 1].attachment) >=
+		    tm_wheel_key(tm_wheels_infos[i].model, tm_wheels_infos[i].attachment))
+			return false;
+
+	return true;
+}
+
+/*
+ * Wheels added at runtime, freed only when the module is unloaded
+ */
+#define TM_EXTRA_MAX 64
+#define TM_EXTRA_STEPS_MAX 8
+#define TM_NAME_SIZE 64
+
+struct tm_wheel_extra {
+	struct list_head list;
+	struct tm_wheel_info info;
+	struct tm_switch_step steps[TM_EXTRA_STEPS_MAX];
+	char name[TM_NAME_SIZE];
+};
+
+static LIST_HEAD(tm_extra_wheels);
+static unsigned int tm_extra_count;
+
+/*
+ * Parses "value[/delay_ms][,value[/delay_ms]...]", the wValues of
+ * the change requests to send with the delay after each one
+ */
+static int thrustmaster_parse_steps(char *str, struct tm_switch_step *steps, unsigned int *count)
+{
+	char *item, *delay;
+
+	*count = 0;
+	while ((item = strsep(&str, ","))) {
+		if (*count >= TM_EXTRA_STEPS_MAX)
+			return -E2BIG;
+
+		delay = strchr(item, '/');
+		if (delay)
+			*delay++ = '\0';
+
+		steps[*count].type = TM_STEP_CONTROL;
+		if (kstrtou16(item, 0, &steps[*count].value) ||
+		    (delay && kstrtouint(delay, 0, &steps[*count].delay_ms)))
+			return -EINVAL;
+		(*count)++;
+	}
+
+	return *count ? 0 : -EINVAL;
+}
+
+/*
+ * Writing "model attachment steps name" adds a wheel or replaces the known
+ * one with the same model and attachment, steps as in
+ * thrustmaster_parse_steps(). E.g.
+ * echo "0x02 0x0a 0x0005 Thrustmaster T300RS (New Attachment)" > new_wheel
+ * A new attachment of a known model gets the quirks of that model.
+ */
+static ssize_t new_wheel_store(struct device_driver *drv, const char *buf, size_t count)
+{
+	struct tm_wheel_extra *extra;
+	const struct tm_wheel_info *same_model;
+	char steps[64];
+	uint8_t model, attachment;
+	bool attachment_found;
+	int name_start, ret;
+
+	if (sscanf(buf, "%hhi %hhi %63s %n", &model, &attachment, steps, &name_start) != 3)
+		return -EINVAL;
+
+	extra = kzalloc(sizeof(*extra), GFP_KERNEL);
+	if (!extra)
+		return -ENOMEM;
+
+	ret = thrustmaster_parse_steps(steps, extra->steps, &extra->info.switch_steps_count);
+	if (ret)
+		goto error;
+
+	strscpy(extra->name, buf + name_start, TM_NAME_SIZE);
+	strim(extra->name);
+	if (!extra->name[0]) {
+		ret = -EINVAL;
+		goto error;
+	}
+
+	extra->info.model = model;
+	extra->info.attachment = attachment;
+	extra->info.switch_steps = extra->steps;
+	extra->info.wheel_name = extra->name;
+
+	same_model = thrustmaster_find_wheel(model, attachment, &attachment_found);
+	if (same_model)
+		extra->info.quirks = same_model->quirks;
+
+	mutex_lock(&tm_db_lock);
+	if (tm_extra_count >= TM_EXTRA_MAX) {
+		mutex_unlock(&tm_db_lock);
+		ret = -ENOSPC;
+		goto error;
+	}
+	list_add_tail(&extra->list, &tm_extra_wheels);
+	tm_extra_count++;
+	mutex_unlock(&tm_db_lock);
+
+	// Once in the list it is freed at unload, even if the insert fails
+	ret = thrustmaster_db_insert(&extra->info);
+	return ret ? ret : count;
+
+error:
+	kfree(extra);
+	return ret;
+}
+static DRIVER_ATTR_WO(new_wheel);
+
+/*
+ * Lists the wheels that can be recognized, one per line as
+ * "model attachment steps name"
+ */
+static ssize_t wheels_show(struct device_driver *drv, char *buf)
+{
+	const struct tm_wheel_db *db;
+	const struct tm_wheel_info *twi;
+	unsigned int i, j;
+	ssize_t len = 0;
+
+	rcu_read_lock();
+	db = rcu_dereference(tm_db);
+	for (i = 0; i < db->count; i++) {
+		twi = db->infos[i];
+		len += sysfs_emit_at(buf, len, "0x%02x 0x%02x ", twi->model, twi->attachment);
+		for (j = 0; j < twi->switch_steps_count; j++) {
+			if (twi->switch_steps[j].type == TM_STEP_CONTROL)
+				len += sysfs_emit_at(buf, len, "%s0x%04x", j ? "," : "", twi->switch_steps[j].value);
+			else
+				len += sysfs_emit_at(buf, len, "%sirq", j ? "," : "");
+			if (twi->switch_steps[j].delay_ms)
+				len += sysfs_emit_at(buf, len, "/%u", twi->switch_steps[j].delay_ms);
+		}
+		len += sysfs_emit_at(buf, len, " %s\n", twi->wheel_name);
+	}
+	rcu_read_unlock();
+
+	return len;
+}
+static DRIVER_ATTR_RO(wheels);
+
+static int thrustmaster_db_init(void)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(tm_wheels_infos); i++) {
+		ret = thrustmaster_db_insert(tm_wheels_infos + i);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+// Called at unload, when nobody can look wheels up anymore
+static void thrustmaster_db_free(void)
+{
+	struct tm_wheel_extra *extra, *tmp;
+
+	kfree(rcu_dereference_protected(tm_db, 1));
+	RCU_INIT_POINTER(tm_db, NULL);
+
+	list_for_each_entry_safe(extra, tmp, &tm_extra_wheels, list)
+		kfree(extra);
+}
+
+/*
+ * Models of the wheels already seen, keyed by USB serial number or, if the
+ * wheel has none, by port path (the name of the usb device, e.g. 1-1.2).
+ * A wheel found here is switched right away, the model request is sent only
+ * afterwards to check that the entry is still right.
+ *
+ * Filled when a wheel is recognized, by the model_cache parameter and by
+ * writing the model_cache attribute of the driver. When full the least
+ * recently used entry is replaced.
+ */
+#define TM_CACHE_SIZE 32
+#define TM_CACHE_KEY_SIZE 64
+
+struct tm_cache_entry {
+	char key[TM_CACHE_KEY_SIZE];
+	uint8_t model;
+	uint8_t attachment;
+	unsigned long last_used;
+	// Set when the wheel has been switched, for tminit_get_identity()
+	bool switched;
+	unsigned long switched_at;
+	u64 init_ns;
+	// Port path of the wheel when it has been switched
+	char port[TM_CACHE_KEY_SIZE];
+};
+
+static struct tm_cache_entry tm_cache[TM_CACHE_SIZE];
+static DEFINE_SPINLOCK(tm_cache_lock);
+
+/*
+ * Key under which the wheel is stored: its serial number if it fits,
+ * otherwise its port path
+ */
+static const char *thrustmaster_cache_key(struct usb_device *udev)
+{
+	if (udev->serial && udev->serial[0] && strlen(udev->serial) < TM_CACHE_KEY_SIZE)
+		return udev->serial;
+
+	return dev_name(&udev->dev);
+}
+
+// Called with tm_cache_lock held
+static struct tm_cache_entry *thrustmaster_cache_find(const char *key)
+{
+	int i;
+
+	for (i = 0; i < TM_CACHE_SIZE; i++)
+		if (tm_cache[i].key[0] && !strcmp(tm_cache[i].key, key))
+			return tm_cache + i;
+
+	return NULL;
+}
+
+// Called with tm_cache_lock held
+static void thrustmaster_cache_set(const char *key, uint8_t model, uint8_t attachment)
+{
+	struct tm_cache_entry *entry = thrustmaster_cache_find(key);
+	int i;
+
+	if (!entry) {
+		entry = tm_cache;
+		for (i = 0; i < TM_CACHE_SIZE && entry->key[0]; i++)
+			if (!tm_cache[i].key[0] || time_before(tm_cache[i].last_used, entry->last_used))
+				entry = tm_cache + i;
+		strscpy(entry->key, key, TM_CACHE_KEY_SIZE);
+	}
+
+	entry->model = model;
+	entry->attachment = attachment;
+	entry->last_used = jiffies;
+	entry->switched = false;
+}
+
+static void thrustmaster_cache_store(struct usb_device *udev, uint8_t model, uint8_t attachment)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tm_cache_lock, flags);
+	thrustmaster_cache_set(thrustmaster_cache_key(udev), model, attachment);
+	spin_unlock_irqrestore(&tm_cache_lock, flags);
+}
+
+/*
+ * Looks for the wheel by serial number and then by port path, returns true
+ * if it has been found
+ */
+static bool thrustmaster_cache_lookup(struct usb_device *udev, uint8_t *model, uint8_t *attachment)
+{
+	struct tm_cache_entry *entry = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tm_cache_lock, flags);
+	if (udev->serial && udev->serial[0])
+		entry = thrustmaster_cache_find(udev->serial);
+	if (!entry)
+		entry = thrustmaster_cache_find(dev_name(&udev->dev));
+	if (entry) {
+		*model = entry->model;
+		*attachment = entry->attachment;
+		entry->last_used = jiffies;
+	}
+	spin_unlock_irqrestore(&tm_cache_lock, flags);
+
+	return entry != NULL;
+}
+
+/*
+ * Priority of the wheel in priorities, looked up by serial number and then
+ * by port path. Wheels not listed have priority 0.
+ */
+static int thrustmaster_priority(struct usb_device *udev)
+{
+	char *str, *cur, *entry, *sep;
+	int priority = 0, value;
+	bool by_serial = false;
+
+	if (!priorities)
+		return 0;
+
+	str = kstrdup(priorities, GFP_KERNEL);
+	if (!str)
+		return 0;
+
+	cur = str;
+	while ((entry = strsep(&cur, ", \n"))) {
+		sep = strrchr(entry, ':');
+		if (!sep || kstrtoint(sep + 1, 0, &value))
+			continue;
+		*sep = '\0';
+
+		if (udev->serial && udev->serial[0] && !strcmp(entry, udev->serial)) {
+			priority = value;
+			by_serial = true;
+		} else if (!by_serial && !strcmp(entry, dev_name(&udev->dev))) {
+			priority = value;
+		}
+	}
+
+	kfree(str);
+	return priority;
+}
+
+// Records that the wheel stored in the cache has been switched
+static void thrustmaster_cache_switched(struct usb_device *udev, u64 init_ns)
+{
+	struct tm_cache_entry *entry;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tm_cache_lock, flags);
+	entry = thrustmaster_cache_find(thrustmaster_cache_key(udev));
+	if (entry) {
+		entry->switched = true;
+		entry->switched_at = jiffies;
+		entry->init_ns = init_ns;
+		strscpy(entry->port, dev_name(&udev->dev), TM_CACHE_KEY_SIZE);
+	}
+	spin_unlock_irqrestore(&tm_cache_lock, flags);
+}
+
+// Called with tm_cache_lock held
+static bool thrustmaster_identity_valid(const struct tm_cache_entry *entry)
+{
+	return entry->switched &&
+	       time_before(jiffies, entry->switched_at + msecs_to_jiffies(identity_ttl_ms));
+}
+
+// Called with tm_cache_lock held
+static bool thrustmaster_identity_match(const struct tm_cache_entry *entry, bool fresh)
+{
+	return fresh ? thrustmaster_identity_valid(entry) : entry->switched;
+}
+
+/*
+ * Looks for a switched wheel with the serial number or the port path of udev,
+ * if fresh only among the ones switched less than identity_ttl_ms ago.
+ * Called with tm_cache_lock held.
+ */
+static struct tm_cache_entry *thrustmaster_identity_find(struct usb_device *udev, bool fresh)
+{
+	struct tm_cache_entry *entry = NULL;
+	int i;
+
+	if (udev->serial && udev->serial[0])
+		entry = thrustmaster_cache_find(udev->serial);
+	if (entry && thrustmaster_identity_match(entry, fresh))
+		return entry;
+
+	for (i = 0; i < TM_CACHE_SIZE; i++)
+		if (thrustmaster_identity_match(tm_cache + i, fresh) &&
+		    !strcmp(tm_cache[i].port, dev_name(&udev->dev)))
+			return tm_cache + i;
+
+	return NULL;
+}
+
+int tminit_get_identity(struct usb_device *udev, struct tminit_identity *identity)
+{
+	const struct tm_wheel_info *twi;
+	struct tm_cache_entry *entry;
+	bool attachment_found;
+	unsigned long flags;
+	int ret = -ENOENT;
+
+	spin_lock_irqsave(&tm_cache_lock, flags);
+	entry = thrustmaster_identity_find(udev, true);
+	if (entry) {
+		identity->model = entry->model;
+		identity->attachment = entry->attachment;
+		identity->init_ns = entry->init_ns;
+		identity->switched_at = entry->switched_at;
+		ret = 0;
+	}
+	spin_unlock_irqrestore(&tm_cache_lock, flags);
+
+	if (!ret) {
+		twi = thrustmaster_find_wheel(identity->model, identity->attachment, &attachment_found);
+		identity->name = twi ? twi->wheel_name : NULL;
+	}
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(tminit_get_identity);
+
+/*
+ * Lists the wheels switched less than identity_ttl_ms ago, one per line as
+ * "port model attachment init_usec age_ms"
+ */
+static ssize_t identities_show(struct device_driver *drv, char *buf)
+{
+	struct tm_cache_entry *entry;
+	unsigned long flags;
+	ssize_t len = 0;
+	int i;
+
+	spin_lock_irqsave(&tm_cache_lock, flags);
+	for (i = 0; i < TM_CACHE_SIZE; i++) {
+		entry = tm_cache + i;
+		if (!thrustmaster_identity_valid(entry))
+			continue;
+
+		len += sysfs_emit_at(buf, len, "%s 0x%02x 0x%02x %llu %u\n", entry->port,
+				     entry->model, entry->attachment, div_u64(entry->init_ns, NSEC_PER_USEC),
+				     jiffies_to_msecs(jiffies - entry->switched_at));
+	}
+	spin_unlock_irqrestore(&tm_cache_lock, flags);
+
+	return len;
+}
+static DRIVER_ATTR_RO(identities);
+
+/*
+ * Adds to the cache the entries in buf, in the format of model_cache.
+ * Writing "clear" empties the cache.
+ */
+static int thrustmaster_cache_parse(const char *buf)
+{
+	char *str, *cur, *entry, *model, *attachment;
+	uint8_t m, a;
+	unsigned long flags;
+	int ret = 0;
+
+	if (sysfs_streq(buf, "clear")) {
+		spin_lock_irqsave(&tm_cache_lock, flags);
+		memset(tm_cache, 0, sizeof(tm_cache));
+		spin_unlock_irqrestore(&tm_cache_lock, flags);
+		return 0;
+	}
+
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	cur = str;
+	while ((entry = strsep(&cur, ", \n")) && !ret) {
+		if (!*entry)
+			continue;
+
+		attachment = strrchr(entry, ':');
+		if (!attachment) {
+			ret = -EINVAL;
+			break;
+		}
+		*attachment++ = '\0';
+
+		model = strrchr(entry, ':');
+		if (!model) {
+			ret = -EINVAL;
+			break;
+		}
+		*model++ = '\0';
+
+		if (!*entry || strlen(entry) >= TM_CACHE_KEY_SIZE ||
+		    kstrtou8(model, 0, &m) || kstrtou8(attachment, 0, &a)) {
+			ret = -EINVAL;
+			break;
+		}
+
+		spin_lock_irqsave(&tm_cache_lock, flags);
+		thrustmaster_cache_set(entry, m, a);
+		spin_unlock_irqrestore(&tm_cache_lock, flags);
+	}
+
+	kfree(str);
+	return ret;
+}
+
+static ssize_t model_cache_show(struct device_driver *drv, char *buf)
+{
+	unsigned long flags;
+	ssize_t len = 0;
+	int i;
+
+	spin_lock_irqsave(&tm_cache_lock, flags);
+	for (i = 0; i < TM_CACHE_SIZE; i++)
+		if (tm_cache[i].key[0])
+			len += sysfs_emit_at(buf, len, "%s:0x%02x:0x%02x\n", tm_cache[i].key,
+					     tm_cache[i].model, tm_cache[i].attachment);
+	spin_unlock_irqrestore(&tm_cache_lock, flags);
+
+	return len;
+}
+
+static ssize_t model_cache_store(struct device_driver *drv, const char *buf, size_t count)
+{
+	int ret = thrustmaster_cache_parse(buf);
+
+	return ret ? ret : count;
+}
+static DRIVER_ATTR_RW(model_cache);
+
+/*
+ * This structs contains (in little endian) the response data
+ * of the wheel to the request 73
+ *
+ * A sufficient research to understand what each field does is not
+ * beign conducted yet. The position and meaning of fields are a
+ * just a very optimistic guess based on instinct....
+ */
+struct __packed tm_wheel_response
+{
+	/*
+	 * Seems to be the type of packet
+	 * - 0x0049 if is data.a (15 bytes)
+	 * - 0x0047 if is data.b (7 bytes)
+	 */
+	uint16_t type;
+
+	union {
+		struct __packed {
+			uint16_t field0;
+			uint16_t field1;
+			/*
+			 * Seems to be the model code of the wheel
+			 * Read table thrustmaster_wheels to values
+			 */
+			uint8_t attachment;
+			uint8_t model;
+
+			uint16_t field2;
+			uint16_t field3;
+			uint16_t field4;
+			uint16_t field5;
+		} a;
+		struct __packed {
+			uint16_t field0;
+			uint16_t field1;
+			uint8_t attachment;
+			uint8_t model;
+		} b;
+	} data;
+};
+
+/*
+ * The known layouts of tm_wheel_response, told apart by their type.
+ * A new layout only needs a new entry here.
+ */
+struct tm_response_format {
+	uint16_t type;
+	// Shortest answer that contains the model and the attachment
+	unsigned int min_length;
+	unsigned int model_offset;
+	unsigned int attachment_offset;
+};
+
+#define TM_RESPONSE_FORMAT(_type, _layout) {					\
+	.type = (_type),							\
+	.min_length = offsetofend(struct tm_wheel_response, data._layout),	\
+	.model_offset = offsetof(struct tm_wheel_response, data._layout.model),	\
+	.attachment_offset = offsetof(struct tm_wheel_response, data._layout.attachment), \
+}
+
+enum {
+	TM_RESPONSE_A,
+	TM_RESPONSE_B
+};
+
+static const struct tm_response_format tm_response_formats[] = {
+	[TM_RESPONSE_A] = TM_RESPONSE_FORMAT(0x0049, a),
+	[TM_RESPONSE_B] = TM_RESPONSE_FORMAT(0x0047, b),
+};
+
+/*
+ * Phases of the initialization of a wheel, in the order they are performed
+ */
+enum tm_wheel_state {
+	TM_STATE_SETUP,		// Sending the setup interrupts, if needed
+	TM_STATE_QUERY_MODEL,	// Waiting for the answer with the model
+	TM_STATE_SWITCH,	// Sending the switch steps of the wheel
+	TM_STATE_VERIFY,	// Switched using tm_cache, checking the model
+	TM_STATE_DONE,
+	TM_STATE_FAILED
+};
+
+static const char *const tm_state_names[] = {
+	[TM_STATE_SETUP] = "setup",
+	[TM_STATE_QUERY_MODEL] = "query_model",
+	[TM_STATE_SWITCH] = "switch",
+	[TM_STATE_VERIFY] = "verify",
+	[TM_STATE_DONE] = "done",
+	[TM_STATE_FAILED] = "failed"
+};
+
+/*
+ * Input device of the generic wheel when fast_input is set. The position of
+ * the axes, the hat switch and the buttons in the input report is taken from
+ * the report descriptor at probe, then each report is decoded by
+ * thrustmaster_raw_event() without going through hid-input.
+ */
+#define TM_FAST_MAX_AXES 8
+#define TM_FAST_MAX_BUTTONS 32
+
+struct tm_fast_value {
+	unsigned int code;
+	// Position in bits, after the report id if there is one
+	unsigned int offset;
+	unsigned int size;
+	// Logical range of the field
+	s32 minimum;
+	s32 maximum;
+};
+
+struct tm_fast_input {
+	struct input_dev *input;
+	const struct hid_report *report;
+	unsigned int axes_count;
+	struct tm_fast_value axes[TM_FAST_MAX_AXES];
+	unsigned int buttons_count;
+	struct tm_fast_value buttons[TM_FAST_MAX_BUTTONS];
+	// Reported as ABS_HAT0X and ABS_HAT0Y
+	bool has_hat;
+	struct tm_fast_value hat;
+};
+
+/*
+ * Data stages of the transfers of a wheel, in usb_alloc_coherent() memory so
+ * that they are not mapped at every submission. The setup interrupts are
+ * filled at probe.
+ */
+struct tm_dma_bufs {
+	struct tm_wheel_response response;
+	u8 setup_bufs[ARRAY_SIZE(setup_arr)][TM_SETUP_MAX_SIZE];
+	u8 switch_buf[TM_SWITCH_MAX_SIZE];
+};
+
+#define TM_BUF_DMA(tm_wheel, field) ((tm_wheel)->bufs_dma + offsetof(struct tm_dma_bufs, field))
+
+struct tm_wheel {
+	// Entry of tm_wheels
+	struct list_head node;
+	struct hid_device *hdev;
+	struct usb_device *usb_dev;
+	struct urb *urb;
+	// Every URB in flight, of the setup chain, the model query or the switch
+	struct usb_anchor anchor;
+	// Interrupt out endpoint, NULL if the interface doesn't have it
+	struct usb_host_endpoint *int_ep;
+
+	enum tm_wheel_state state;
+	// Attempts already made in the current phase
+	unsigned int retries;
+	// Starts the init and runs the next attempt of the current phase
+	struct delayed_work work;
+	// Entry of tm_pending while waiting for an init slot
+	struct list_head pending;
+	// Order in tm_pending, higher first, see priorities
+	int priority;
+	// Holds one of the max_inflight init slots
+	bool inflight;
+	// Set while the device is suspended, no new attempt is scheduled
+	bool suspended;
+
+	// Pacing of the init, see the module parameters of the same name
+	unsigned int setup_timeout_ms;
+	unsigned int query_timeout_ms;
+	unsigned int switch_timeout_ms;
+	unsigned int phase_gap_ms;
+	// Unlinks the URBs in flight once the timeout of the transfer expires
+	struct delayed_work timeout_work;
+	// When the timeout of the last URB submitted expires, under timeout_lock
+	unsigned long timeout_at;
+	spinlock_t timeout_lock;
+
+	/*
+	 * The completions of urb, and of the last URB of the setup chain, only
+	 * save the outcome, it is processed by complete_work calling complete
+	 */
+	struct work_struct complete_work;
+	void (*complete)(struct tm_wheel *tm_wheel);
+	int urb_status;
+	u32 urb_length;
+
+	// When the wheel was probed and when the current phase started
+	ktime_t probe_time;
+	ktime_t phase_start;
+	// Time spent in each of the phases before TM_STATE_DONE, retries included
+	s64 phase_ns[TM_STATE_DONE];
+	// From probe to the end of the switch or TM_STATE_FAILED
+	s64 total_ns;
+
+	// Statistics shown in sysfs, see thrustmaster_attrs[]
+	unsigned int attempts;		// Model requests and switch steps submitted
+	int last_status;		// Status of the last completed transfer
+	unsigned int transfers_ok;
+	unsigned int transfers_failed;
+
+	// What the wheel answered to the model request, valid if identified
+	bool identified;
+	uint8_t model;
+	uint8_t attachment;
+	bool attachment_found;
+
+	// The model has been taken from tm_cache instead of asking the wheel
+	bool from_cache;
+
+	// Used if fast_input is set and the report layout has been recognized
+	struct tm_fast_input fast;
+
+	/*
+	 * What is connected of the generic wheel. If quiet it is connected
+	 * by connect_work only when the init fails.
+	 */
+	unsigned int connect_mask;
+	bool quiet;
+	struct work_struct connect_work;
+
+	// Tells userspace that the init is over, see thrustmaster_uevent_work()
+	struct work_struct uevent_work;
+	// Serialises the writes to the rescan attribute
+	struct mutex rescan_lock;
+
+	// Results of bench_iterations, see thrustmaster_bench()
+	struct dentry *bench_file;
+	bool bench_done;
+	unsigned int bench_count;
+	unsigned int bench_errors;
+	// min, median and 99th percentile in ns
+	u64 bench_setup_ns[3];
+	u64 bench_query_ns[3];
+
+	// Set when the model has been recognized
+	const struct tm_wheel_info *twi;
+	// Index in twi->switch_steps of the step being sent
+	unsigned int switch_step;
+
+	/*
+	 * Chain of interrupt URBs carrying setup_arr[], each completion
+	 * submits the next one and the last one submits the model request
+	 */
+	struct urb *setup_urbs[ARRAY_SIZE(setup_arr)];
+	unsigned int setup_step;
+
+	/*
+	 * Setup packet of the switch steps. The structure comes from
+	 * devm_kzalloc(), so it is DMA-safe.
+	 */
+	struct usb_ctrlrequest change_request ____cacheline_aligned;
+
+	// Data stages of the transfers, mapped once when allocated
+	struct tm_dma_bufs *bufs;
+	dma_addr_t bufs_dma;
+};
+
+/* The control packet to send to wheel */
+static const struct usb_ctrlrequest model_request = {
+	.bRequestType = 0xc1,
+	.bRequest = 73,
+	.wValue = 0,
+	.wIndex = 0,
+	.wLength = cpu_to_le16(0x0010)
+};
+
+static const struct usb_ctrlrequest change_request = {
+	.bRequestType = 0x41,
+	.bRequest = 83,
+	.wValue = 0, // Will be filled by the driver
+	.wIndex = 0,
+	.wLength = 0
+};
+
+/*
+ * Copy of model_request sent to every wheel, made when the module is loaded.
+ * It is read-only and shared by all the wheels, kmemdup() makes it DMA-safe.
+ * The data stages are in the coherent buffers of each wheel instead.
+ */
+static struct usb_ctrlrequest *tm_model_request;
+
+// The data stage of urb is at dma in the coherent buffers of the wheel
+static void thrustmaster_set_dma(struct urb *urb, dma_addr_t dma)
+{
+	urb->transfer_dma = dma;
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+}
+
+/*
+ * Every wheel bound to the driver, for the summary attribute
+ */
+static LIST_HEAD(tm_wheels);
+static DEFINE_MUTEX(tm_wheels_lock);
+
+static void thrustmaster_model_handler(struct urb *urb);
+static void thrustmaster_change_handler(struct urb *urb);
+static void thrustmaster_model_complete(struct tm_wheel *tm_wheel);
+static void thrustmaster_change_complete(struct tm_wheel *tm_wheel);
+static void thrustmaster_defer(struct tm_wheel *tm_wheel, struct urb *urb, int status,
+			       void (*complete)(struct tm_wheel *tm_wheel));
+static int thrustmaster_interrupts(struct hid_device *hdev, gfp_t mem_flags);
+static void thrustmaster_bench(struct tm_wheel *tm_wheel);
+
+/*
+ * The URB has been killed or the device is gone, there is no point in retrying
+ */
+static bool thrustmaster_urb_killed(int status)
+{
+	return status == -ENOENT || status == -ESHUTDOWN;
+}
+
+/*
+ * Submits one of the URBs of the wheel, anchored so that it can be killed
+ * along with the others. Fails once the anchor has been poisoned.
+ * If it hasn't completed after timeout_ms it is unlinked, 0 waits forever.
+ */
+static int thrustmaster_submit_urb(struct tm_wheel *tm_wheel, struct urb *urb, unsigned int timeout_ms,
+				   gfp_t mem_flags)
+{
+	unsigned long timeout = timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_JIFFY_OFFSET;
+	unsigned long flags;
+	int ret;
+
+	/*
+	 * Armed before the submission, the URB may complete right away. The
+	 * deadline is set even without a timeout, the work may still be
+	 * pending for the previous URB.
+	 */
+	spin_lock_irqsave(&tm_wheel->timeout_lock, flags);
+	tm_wheel->timeout_at = jiffies + timeout;
+	spin_unlock_irqrestore(&tm_wheel->timeout_lock, flags);
+	if (timeout_ms)
+		mod_delayed_work(tm_wq, &tm_wheel->timeout_work, timeout);
+
+	usb_anchor_urb(urb, &tm_wheel->anchor);
+	ret = usb_submit_urb(urb, mem_flags);
+	if (ret) {
+		usb_unanchor_urb(urb);
+		cancel_delayed_work(&tm_wheel->timeout_work);
+	}
+
+	return ret;
+}
+
+static void thrustmaster_timeout_work(struct work_struct *work)
+{
+	struct tm_wheel *tm_wheel = container_of(to_delayed_work(work), struct tm_wheel, timeout_work);
+	unsigned long flags;
+
+	/*
+	 * The work may run late, for an URB that completed meanwhile. The URB
+	 * submitted next has set its own deadline first: it is only unlinked
+	 * once that one has passed. Under the lock, a submission that hasn't
+	 * set it yet can't be anchored either.
+	 */
+	spin_lock_irqsave(&tm_wheel->timeout_lock, flags);
+	if (time_after_eq(jiffies, tm_wheel->timeout_at))
+		usb_unlink_anchored_urbs(&tm_wheel->anchor);
+	spin_unlock_irqrestore(&tm_wheel->timeout_lock, flags);
+}
+
+/*
+ * Called first by the completion handlers, stops the timeout of the transfer.
+ * Returns the status of urb, -ETIMEDOUT if it has been unlinked because of
+ * the timeout.
+ */
+static int thrustmaster_urb_done(struct tm_wheel *tm_wheel, struct urb *urb)
+{
+	cancel_delayed_work(&tm_wheel->timeout_work);
+
+	// Only thrustmaster_timeout_work() unlinks the URBs
+	if (urb->status == -ECONNRESET)
+		return -ETIMEDOUT;
+
+	return urb->status;
+}
+
+static void thrustmaster_schedule(struct tm_wheel *tm_wheel, unsigned int delay_ms)
+{
+	if (!READ_ONCE(tm_wheel->suspended))
+		queue_delayed_work(tm_wq, &tm_wheel->work, msecs_to_jiffies(delay_ms));
+}
+
+static bool thrustmaster_slot_available(void)
+{
+	return !max_inflight || tm_inflight < max_inflight;
+}
+
+/*
+ * Adds the wheel to tm_pending after the ones with the same or a higher
+ * priority. Called with tm_inflight_lock held.
+ */
+static void thrustmaster_pending_add(struct tm_wheel *tm_wheel)
+{
+	struct tm_wheel *other;
+
+	list_for_each_entry(other, &tm_pending, pending)
+		if (READ_ONCE(other->priority) < READ_ONCE(tm_wheel->priority))
+			break;
+
+	list_add_tail(&tm_wheel->pending, &other->pending);
+}
+
+/*
+ * Starts the init of the wheel right away if an init slot is available,
+ * otherwise the wheel waits for one in tm_pending
+ */
+static void thrustmaster_queue_init(struct tm_wheel *tm_wheel)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&tm_inflight_lock, flags);
+	// Nothing to do if the wheel already holds a slot or is waiting for one
+	if (!tm_wheel->inflight && list_empty(&tm_wheel->pending)) {
+		if (thrustmaster_slot_available()) {
+			tm_inflight++;
+			tm_wheel->inflight = true;
+		} else {
+			thrustmaster_pending_add(tm_wheel);
+		}
+	}
+
+	if (tm_wheel->inflight)
+		thrustmaster_schedule(tm_wheel, 0);
+	spin_unlock_irqrestore(&tm_inflight_lock, flags);
+}
+
+/*
+ * Gives back the init slot of the wheel, if it holds one, and starts the
+ * init of the wheels waiting for it. May be called from completion context.
+ */
+static void thrustmaster_release_slot(struct tm_wheel *tm_wheel)
+{
+	struct tm_wheel *next;
+	unsigned long flags;
+
+	spin_lock_irqsave(&tm_inflight_lock, flags);
+	list_del_init(&tm_wheel->pending);
+	if (tm_wheel->inflight) {
+		tm_wheel->inflight = false;
+		tm_inflight--;
+	}
+
+	while (!list_empty(&tm_pending) && thrustmaster_slot_available()) {
+		next = list_first_entry(&tm_pending, struct tm_wheel, pending);
+		list_del_init(&next->pending);
+		tm_inflight++;
+		next->inflight = true;
+		thrustmaster_schedule(next, 0);
+	}
+	spin_unlock_irqrestore(&tm_inflight_lock, flags);
+}
+
+static void thrustmaster_record_status(struct tm_wheel *tm_wheel, int status, bool ok)
+{
+	tm_wheel->last_status = status;
+	if (ok)
+		tm_wheel->transfers_ok++;
+	else
+		tm_wheel->transfers_failed++;
+}
+
+static void thrustmaster_set_state(struct tm_wheel *tm_wheel, enum tm_wheel_state state)
+{
+	ktime_t now;
+	s64 elapsed;
+
+	if (tm_wheel->state != state) {
+		now = ktime_get();
+		elapsed = ktime_to_ns(ktime_sub(now, tm_wheel->phase_start));
+		if (tm_wheel->state < TM_STATE_DONE)
+			tm_wheel->phase_ns[tm_wheel->state] += elapsed;
+		if (tm_wheel->state < TM_STATE_VERIFY && state >= TM_STATE_VERIFY)
+			tm_wheel->total_ns = ktime_to_ns(ktime_sub(now, tm_wheel->probe_time));
+		trace_tminit_state(tm_wheel->hdev, tm_wheel->state, state, elapsed);
+		if (state == TM_STATE_DONE)
+			thrustmaster_cache_switched(tm_wheel->usb_dev, tm_wheel->total_ns);
+
+		tm_wheel->phase_start = now;
+		tm_wheel->state = state;
+		tm_wheel->retries = 0;
+	}
+
+	// The check of tm_cache doesn't need to hold back other wheels
+	if (state >= TM_STATE_VERIFY)
+		thrustmaster_release_slot(tm_wheel);
+
+	// The wheel stays in generic mode, it must be usable as such
+	if (state == TM_STATE_FAILED && tm_wheel->quiet)
+		queue_work(tm_wq, &tm_wheel->connect_work);
+
+	if (state >= TM_STATE_DONE)
+		queue_work(tm_wq, &tm_wheel->uevent_work);
+}
+
+/*
+ * Schedules another attempt of the current phase of the init, waiting twice
+ * as long as the previous time. Gives up after max_retries attempts, or right
+ * away if error is -EINVAL: the transfer can't be sent to this wheel at all.
+ */
+static void thrustmaster_retry(struct hid_device *hdev, int error)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+	unsigned int delay;
+
+	if (error == -EINVAL) {
+		hid_err(hdev, "Invalid transfer in the %s phase, I am unable to initialize this wheel...\n",
+			tm_state_names[tm_wheel->state]);
+		thrustmaster_set_state(tm_wheel, TM_STATE_FAILED);
+		return;
+	}
+
+	if (tm_wheel->retries >= max_retries) {
+		hid_err(hdev, "Giving up after %u retries, I am unable to initialize this wheel...\n", tm_wheel->retries);
+		thrustmaster_set_state(tm_wheel, TM_STATE_FAILED);
+		return;
+	}
+
+	// In 64 bits, retry_delay_ms can be large enough for the shift to overflow
+	delay = min_t(u64, (u64)retry_delay_ms << min(tm_wheel->retries, 16U), retry_delay_max_ms);
+	tm_wheel->retries++;
+	tm_dbg(hdev, "Retry %u of the %s phase in %u ms\n", tm_wheel->retries, tm_state_names[tm_wheel->state], delay);
+	thrustmaster_schedule(tm_wheel, delay);
+}
+
+/*
+ * Enters state after phase_gap_ms, thrustmaster_work() will send its first
+ * transfer. Returns false if there is no gap to wait.
+ */
+static bool thrustmaster_wait_gap(struct tm_wheel *tm_wheel, enum tm_wheel_state state)
+{
+	unsigned int gap_ms = READ_ONCE(tm_wheel->phase_gap_ms);
+
+	if (!gap_ms)
+		return false;
+
+	thrustmaster_set_state(tm_wheel, state);
+	tm_wheel->switch_step = 0;
+	thrustmaster_schedule(tm_wheel, gap_ms);
+	return true;
+}
+
+/*
+ * Sends the USB CONTROL REQUEST that asks the wheel for [what it seems to be]
+ * its model type, the answer is processed by thrustmaster_model_complete().
+ */
+static int thrustmaster_submit_model_request(struct hid_device *hdev, gfp_t mem_flags)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+	int ret;
+
+	if (tm_wheel->state != TM_STATE_VERIFY)
+		thrustmaster_set_state(tm_wheel, TM_STATE_QUERY_MODEL);
+	usb_fill_control_urb(
+		tm_wheel->urb,
+		tm_wheel->usb_dev,
+		usb_rcvctrlpipe(tm_wheel->usb_dev, 0),
+		(char *)tm_model_request,
+		&tm_wheel->bufs->response,
+		sizeof(struct tm_wheel_response),
+		thrustmaster_model_handler,
+		hdev
+	);
+	thrustmaster_set_dma(tm_wheel->urb, TM_BUF_DMA(tm_wheel, response));
+
+	tm_wheel->attempts++;
+	trace_tminit_model_submit(hdev, tm_wheel->retries);
+	ret = thrustmaster_submit_urb(tm_wheel, tm_wheel->urb, READ_ONCE(tm_wheel->query_timeout_ms), mem_flags);
+	if (ret)
+		tm_err_ratelimited(hdev, "Error %d while submitting the URB\n", ret);
+
+	return ret;
+}
+
+/*
+ * Sends the current step of the sequence that switches the wheel, already
+ * recognized, to its full capabilities. The following steps are sent by
+ * thrustmaster_change_complete().
+ */
+static int thrustmaster_submit_change_request(struct hid_device *hdev, gfp_t mem_flags)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+	const struct tm_switch_step *step;
+	int ret;
+
+	if (tm_wheel->state != TM_STATE_SWITCH) {
+		thrustmaster_set_state(tm_wheel, TM_STATE_SWITCH);
+		tm_wheel->switch_step = 0;
+	}
+	step = &tm_wheel->twi->switch_steps[tm_wheel->switch_step];
+
+	switch (step->type) {
+	case TM_STEP_CONTROL:
+		tm_wheel->change_request.wValue = cpu_to_le16(step->value);
+		usb_fill_control_urb(
+			tm_wheel->urb,
+			tm_wheel->usb_dev,
+			usb_sndctrlpipe(tm_wheel->usb_dev, 0),
+			(char *)&tm_wheel->change_request,
+			NULL, 0, // We do not expect any response from the wheel
+			thrustmaster_change_handler,
+			hdev
+		);
+		tm_wheel->urb->transfer_flags &= ~URB_NO_TRANSFER_DMA_MAP;
+		break;
+	case TM_STEP_INTERRUPT:
+		if (!tm_wheel->int_ep || step->size > TM_SWITCH_MAX_SIZE)
+			return -EINVAL;
+
+		memcpy(tm_wheel->bufs->switch_buf, step->data, step->size);
+		usb_fill_int_urb(
+			tm_wheel->urb,
+			tm_wheel->usb_dev,
+			usb_sndintpipe(tm_wheel->usb_dev, tm_wheel->int_ep->desc.bEndpointAddress),
+			tm_wheel->bufs->switch_buf,
+			step->size,
+			thrustmaster_change_handler,
+			hdev,
+			tm_wheel->int_ep->desc.bInterval
+		);
+		thrustmaster_set_dma(tm_wheel->urb, TM_BUF_DMA(tm_wheel, switch_buf));
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	tm_wheel->attempts++;
+	trace_tminit_switch_submit(hdev, tm_wheel->switch_step);
+	ret = thrustmaster_submit_urb(tm_wheel, tm_wheel->urb, READ_ONCE(tm_wheel->switch_timeout_ms), mem_flags);
+	if (ret)
+		tm_err_ratelimited(hdev, "Error %d while submitting the change URB\n", ret);
+
+	return ret;
+}
+
+/*
+ * If the wheel is in tm_cache it is considered recognized, it will be switched
+ * without asking for its model
+ */
+static void thrustmaster_use_cache(struct tm_wheel *tm_wheel)
+{
+	uint8_t model, attachment;
+	bool attachment_found;
+	const struct tm_wheel_info *twi;
+
+	if (!thrustmaster_cache_lookup(tm_wheel->usb_dev, &model, &attachment))
+		return;
+
+	twi = thrustmaster_find_wheel(model, attachment, &attachment_found);
+	if (!twi)
+		return;
+
+	tm_dbg(tm_wheel->hdev, "Wheel with (model, attachment) = (0x%x, 0x%x) known as a %s, switching it\n", model, attachment, twi->wheel_name);
+	tm_wheel->identified = true;
+	tm_wheel->model = model;
+	tm_wheel->attachment = attachment;
+	tm_wheel->attachment_found = attachment_found;
+	tm_wheel->from_cache = true;
+	tm_wheel->twi = twi;
+}
+
+/*
+ * Whether the setup interrupts have to be sent before going on with the init,
+ * see setup_interrupts
+ */
+static bool thrustmaster_setup_needed(struct tm_wheel *tm_wheel)
+{
+	if (setup_interrupts >= 0)
+		return setup_interrupts > 0;
+
+	return tm_wheel->twi && (tm_wheel->twi->quirks & TM_QUIRK_SETUP_INTERRUPTS);
+}
+
+/*
+ * Goes on with the init after the setup interrupts: asks the wheel for its
+ * model or, if the model is already known, switches it
+ */
+static int thrustmaster_after_setup(struct hid_device *hdev, gfp_t mem_flags)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+
+	if (tm_wheel->twi)
+		return thrustmaster_submit_change_request(hdev, mem_flags);
+
+	return thrustmaster_submit_model_request(hdev, mem_flags);
+}
+
+/*
+ * Starts the init of the wheel once it got an init slot and then runs,
+ * after a delay, the new attempts of the phases that failed
+ */
+static void thrustmaster_work(struct work_struct *work)
+{
+	struct tm_wheel *tm_wheel = container_of(to_delayed_work(work), struct tm_wheel, work);
+	struct hid_device *hdev = tm_wheel->hdev;
+	int ret;
+
+	switch (tm_wheel->state) {
+	case TM_STATE_SETUP:
+		if (bench_iterations && !tm_wheel->bench_done)
+			thrustmaster_bench(tm_wheel);
+
+		// The init slot has just been obtained, waiting for it doesn't count
+		tm_wheel->phase_start = ktime_get();
+
+		if (!tm_wheel->twi)
+			thrustmaster_use_cache(tm_wheel);
+
+		// The init goes on at the end of the setup chain
+		if (thrustmaster_setup_needed(tm_wheel) && !thrustmaster_interrupts(hdev, GFP_KERNEL))
+			return;
+
+		ret = thrustmaster_after_setup(hdev, GFP_KERNEL);
+		break;
+	case TM_STATE_QUERY_MODEL:
+		ret = thrustmaster_submit_model_request(hdev, GFP_KERNEL);
+		break;
+	case TM_STATE_SWITCH:
+		ret = thrustmaster_submit_change_request(hdev, GFP_KERNEL);
+		break;
+	case TM_STATE_VERIFY:
+		// The wheel has already been switched, the check is not retried
+		if (thrustmaster_submit_model_request(hdev, GFP_KERNEL))
+			thrustmaster_set_state(tm_wheel, TM_STATE_DONE);
+		return;
+	default:
+		return;
+	}
+
+	if (ret)
+		thrustmaster_retry(hdev, ret);
+}
+
+static void thrustmaster_setup_complete(struct tm_wheel *tm_wheel)
+{
+	int ret;
+
+	if (thrustmaster_wait_gap(tm_wheel, tm_wheel->twi ? TM_STATE_SWITCH : TM_STATE_QUERY_MODEL))
+		return;
+
+	ret = thrustmaster_after_setup(tm_wheel->hdev, GFP_KERNEL);
+	if (ret)
+		thrustmaster_retry(tm_wheel->hdev, ret);
+}
+
+/*
+ * Called by the USB subsystem every time a setup interrupt has been sent.
+ * Submits the next one of the chain or, when the chain is over or broken,
+ * has thrustmaster_setup_complete() go on with the init: asking the wheel for
+ * its model or, if the model is already known, switching it.
+ */
+static void thrustmaster_setup_handler(struct urb *urb)
+{
+	struct hid_device *hdev = urb->context;
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+	int status, ret;
+
+	trace_tminit_setup_complete(hdev, tm_wheel->setup_step, urb);
+	status = thrustmaster_urb_done(tm_wheel, urb);
+	if (thrustmaster_urb_killed(status))
+		return;
+
+	thrustmaster_record_status(tm_wheel, status, !status);
+	if (status) {
+		tm_err_ratelimited(hdev, "setup data couldn't be sent, error %d\n", status);
+		goto next_phase;
+	}
+
+	if (++tm_wheel->setup_step < ARRAY_SIZE(setup_arr)) {
+		trace_tminit_setup_submit(hdev, tm_wheel->setup_step);
+		ret = thrustmaster_submit_urb(tm_wheel, tm_wheel->setup_urbs[tm_wheel->setup_step],
+					      READ_ONCE(tm_wheel->setup_timeout_ms), GFP_ATOMIC);
+		if (!ret)
+			return;
+
+		tm_err_ratelimited(hdev, "setup data couldn't be sent, error %d\n", ret);
+	}
+
+next_phase:
+	thrustmaster_defer(tm_wheel, urb, status, thrustmaster_setup_complete);
+}
+
+/*
+ * On some setups initializing the T300RS crashes the kernel,
+ * these interrupts fix that particular issue. So far they haven't caused any
+ * adverse effects in other wheels. Unless setup_interrupts says otherwise they
+ * are sent only to the wheels marked with TM_QUIRK_SETUP_INTERRUPTS, once
+ * their model is known.
+ *
+ * The interrupts are prepared in advance and then sent asynchronously one
+ * after the other, see thrustmaster_setup_handler(). Returns 0 if the chain
+ * has been started, in that case the init goes on at its end.
+ */
+static int thrustmaster_interrupts(struct hid_device *hdev, gfp_t mem_flags)
+{
+	int ret, i, b_ep;
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+	struct usb_host_endpoint *ep = tm_wheel->int_ep;
+	struct usb_device *usbdev = tm_wheel->usb_dev;
+
+	if (!ep) {
+		hid_err(hdev, "Wrong number of endpoints?\n");
+		return -ENODEV;
+	}
+
+	b_ep = ep->desc.bEndpointAddress;
+
+	for (i = 0; i < ARRAY_SIZE(setup_arr); ++i) {
+		usb_fill_int_urb(
+			tm_wheel->setup_urbs[i],
+			usbdev,
+			usb_sndintpipe(usbdev, b_ep),
+			tm_wheel->bufs->setup_bufs[i],
+			setup_arr_sizes[i],
+			thrustmaster_setup_handler,
+			hdev,
+			ep->desc.bInterval
+		);
+		thrustmaster_set_dma(tm_wheel->setup_urbs[i],
+				     TM_BUF_DMA(tm_wheel, setup_bufs) + i * TM_SETUP_MAX_SIZE);
+	}
+
+	tm_wheel->setup_step = 0;
+	trace_tminit_setup_submit(hdev, 0);
+	ret = thrustmaster_submit_urb(tm_wheel, tm_wheel->setup_urbs[0], READ_ONCE(tm_wheel->setup_timeout_ms),
+				      mem_flags);
+	if (ret) {
+		tm_err_ratelimited(hdev, "setup data couldn't be sent, error %d\n", ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Saves the outcome of the transfer that just completed, complete will
+ * process it from tm_wq where it can sleep
+ */
+static void thrustmaster_defer(struct tm_wheel *tm_wheel, struct urb *urb, int status,
+			       void (*complete)(struct tm_wheel *tm_wheel))
+{
+	tm_wheel->complete = complete;
+	tm_wheel->urb_status = status;
+	tm_wheel->urb_length = urb->actual_length;
+	queue_work(tm_wq, &tm_wheel->complete_work);
+}
+
+static void thrustmaster_complete_work(struct work_struct *work)
+{
+	struct tm_wheel *tm_wheel = container_of(work, struct tm_wheel, complete_work);
+
+	// The interrupted phase is started again by thrustmaster_resume()
+	if (READ_ONCE(tm_wheel->suspended))
+		return;
+
+	tm_wheel->complete(tm_wheel);
+}
+
+static void thrustmaster_change_handler(struct urb *urb)
+{
+	struct hid_device *hdev = urb->context;
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+	int status;
+
+	trace_tminit_switch_complete(hdev, tm_wheel->switch_step, urb);
+	status = thrustmaster_urb_done(tm_wheel, urb);
+	if (thrustmaster_urb_killed(status))
+		return;
+
+	thrustmaster_defer(tm_wheel, urb, status, thrustmaster_change_complete);
+}
+
+static void thrustmaster_change_complete(struct tm_wheel *tm_wheel)
+{
+	struct hid_device *hdev = tm_wheel->hdev;
+	int status = tm_wheel->urb_status;
+	const struct tm_switch_step *step;
+	int ret;
+
+	// The wheel seems to kill himself before answering the host and therefore is violating the USB protocol...
+	if (status && status != -EPROTO && status != -EPIPE) {
+		thrustmaster_record_status(tm_wheel, status, false);
+		tm_warn_ratelimited(hdev, "URB to change wheel mode seems to have failed with error %d\n", status);
+		thrustmaster_retry(hdev, status);
+		return;
+	}
+
+	thrustmaster_record_status(tm_wheel, status, true);
+
+	step = &tm_wheel->twi->switch_steps[tm_wheel->switch_step];
+	if (++tm_wheel->switch_step >= tm_wheel->twi->switch_steps_count) {
+		hid_info(hdev, "Success?! The wheel should have been initialized!\n");
+		if (!tm_wheel->from_cache) {
+			thrustmaster_set_state(tm_wheel, TM_STATE_DONE);
+			return;
+		}
+
+		// If the wheel is still there to answer, check the entry of tm_cache
+		thrustmaster_set_state(tm_wheel, TM_STATE_VERIFY);
+		if (thrustmaster_submit_model_request(hdev, GFP_KERNEL))
+			thrustmaster_set_state(tm_wheel, TM_STATE_DONE);
+		return;
+	}
+
+	// Each step has its own retries
+	tm_wheel->retries = 0;
+	if (step->delay_ms) {
+		thrustmaster_schedule(tm_wheel, step->delay_ms);
+		return;
+	}
+
+	ret = thrustmaster_submit_change_request(hdev, GFP_KERNEL);
+	if (ret)
+		thrustmaster_retry(hdev, ret);
+}
+
+/*
+ * Extracts the model and the attachment from the answer to the model request.
+ * Returns -EMSGSIZE if the answer is too short for its layout and -ENODATA
+ * if the layout is unknown.
+ */
+static int thrustmaster_parse_response(struct device *dev, const struct tm_wheel_response *response,
+				       unsigned int length, uint8_t *model, uint8_t *attachment)
+{
+	static DEFINE_RATELIMIT_STATE(unknown_rs, 60 * HZ, 1);
+	const struct tm_response_format *format;
+	const u8 *bytes = (const u8 *)response;
+	uint16_t type;
+	unsigned int i;
+
+	if (length < sizeof(response->type)) {
+		dev_err_ratelimited(dev, "Answer with the model is %u bytes long, asking again\n", length);
+		return -EMSGSIZE;
+	}
+
+	type = le16_to_cpu(response->type);
+	for (i = 0; i < ARRAY_SIZE(tm_response_formats); i++) {
+		format = tm_response_formats + i;
+		if (format->type != type)
+			continue;
+
+		if (length < format->min_length) {
+			dev_err_ratelimited(dev, "Answer of type 0x%x is %u bytes long instead of at least %u, asking again\n",
+				type, length, format->min_length);
+			return -EMSGSIZE;
+		}
+
+		*model = bytes[format->model_offset];
+		*attachment = bytes[format->attachment_offset];
+		return 0;
+	}
+
+	if (__ratelimit(&unknown_rs)) {
+		dev_err(dev, "Unknown packet type 0x%x\n", type);
+		print_hex_dump(KERN_ERR, KBUILD_MODNAME ": ", DUMP_PREFIX_OFFSET, 16, 1,
+			       response, length, false);
+	}
+
+	return -ENODATA;
+}
+
+/*
+ * Called by the USB subsystem when the wheel responses to our request
+ * to get [what it seems to be] the wheel's model.
+ */
+static void thrustmaster_model_handler(struct urb *urb)
+{
+	struct hid_device *hdev = urb->context;
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+	int status;
+
+	trace_tminit_model_complete(hdev, tm_wheel->retries, urb);
+	status = thrustmaster_urb_done(tm_wheel, urb);
+	if (thrustmaster_urb_killed(status))
+		return;
+
+	thrustmaster_defer(tm_wheel, urb, status, thrustmaster_model_complete);
+}
+
+/*
+ * If the model id is recognized then we send an opportune USB CONTROL REQUEST
+ * to switch the wheel to its full capabilities
+ */
+static void thrustmaster_model_complete(struct tm_wheel *tm_wheel)
+{
+	struct hid_device *hdev = tm_wheel->hdev;
+	int status = tm_wheel->urb_status;
+	uint8_t model = 0;
+	uint8_t attachment = 0;
+	bool attachment_found;
+	const struct tm_wheel_info *twi;
+	bool reswitch = false;
+	int ret;
+
+	thrustmaster_record_status(tm_wheel, status, !status);
+	if (status && tm_wheel->state == TM_STATE_VERIFY) {
+		// Most likely the wheel is leaving after the switch
+		thrustmaster_set_state(tm_wheel, TM_STATE_DONE);
+		return;
+	}
+
+	if (status) {
+		tm_err_ratelimited(hdev, "URB to get model id failed with error %d\n", status);
+		thrustmaster_retry(hdev, status);
+		return;
+	}
+
+	ret = thrustmaster_parse_response(&hdev->dev, &tm_wheel->bufs->response,
+					  min_t(u32, tm_wheel->urb_length, sizeof(tm_wheel->bufs->response)),
+					  &model, &attachment);
+	if (ret == -ENODATA && tm_wheel->state == TM_STATE_VERIFY) {
+		// Not an answer the generic mode gives, the switch worked
+		thrustmaster_set_state(tm_wheel, TM_STATE_DONE);
+		return;
+	} else if (ret) {
+		thrustmaster_retry(hdev, ret);
+		return;
+	}
+
+	if (tm_wheel->state == TM_STATE_VERIFY) {
+		if (model == tm_wheel->model && attachment == tm_wheel->attachment) {
+			thrustmaster_set_state(tm_wheel, TM_STATE_DONE);
+			return;
+		}
+
+		// The wheel is still in generic mode, it has to be switched again
+		tm_dbg(hdev, "Cached (model, attachment) = (0x%x, 0x%x) is stale\n", tm_wheel->model, tm_wheel->attachment);
+		tm_wheel->from_cache = false;
+		reswitch = true;
+	}
+
+	twi = thrustmaster_find_wheel(model, attachment, &attachment_found);
+	tm_wheel->identified = true;
+	tm_wheel->model = model;
+	tm_wheel->attachment = attachment;
+	tm_wheel->attachment_found = attachment_found;
+	if (!twi) {
+		hid_err(hdev, "Unknown wheel's model id 0x%x, unable to proceed further with wheel init\n", model);
+		thrustmaster_set_state(tm_wheel, TM_STATE_FAILED);
+		return;
+	}
+
+	tm_dbg(hdev, "Wheel with (model, attachment) = (0x%x, 0x%x) is a %s. attachment_found=%d\n", model, attachment, twi->wheel_name, attachment_found);
+
+	thrustmaster_cache_store(tm_wheel->usb_dev, model, attachment);
+	tm_wheel->twi = twi;
+	if (reswitch) {
+		/*
+		 * The init slot has been given back for the check, the switch
+		 * starts over from thrustmaster_work() once it has one again
+		 */
+		thrustmaster_set_state(tm_wheel, TM_STATE_SETUP);
+		thrustmaster_queue_init(tm_wheel);
+		return;
+	}
+
+	if (setup_interrupts < 0 && thrustmaster_setup_needed(tm_wheel)) {
+		// The change request is sent at the end of the setup chain
+		thrustmaster_set_state(tm_wheel, TM_STATE_SETUP);
+		if (!thrustmaster_interrupts(hdev, GFP_KERNEL))
+			return;
+	} else if (thrustmaster_wait_gap(tm_wheel, TM_STATE_SWITCH)) {
+		return;
+	}
+
+	ret = thrustmaster_submit_change_request(hdev, GFP_KERNEL);
+	if (ret)
+		thrustmaster_retry(hdev, ret);
+}
+
+/*
+ * Updates the identity of the switched wheel udev, returns true if it changed.
+ * The rim may have been changed long after the switch, identity_ttl_ms is
+ * not checked, the identity is valid again for as long from now on.
+ * Called with tm_cache_lock held.
+ */
+static bool thrustmaster_identity_update(struct usb_device *udev, uint8_t model, uint8_t attachment)
+{
+	struct tm_cache_entry *entry = thrustmaster_identity_find(udev, false);
+	bool changed;
+
+	if (!entry)
+		return false;
+
+	changed = entry->model != model || entry->attachment != attachment;
+	entry->model = model;
+	entry->attachment = attachment;
+	entry->last_used = jiffies;
+	entry->switched_at = jiffies;
+
+	return changed;
+}
+
+int tminit_rescan(struct usb_device *udev, struct tminit_identity *identity)
+{
+	char env_model[16], env_attachment[32], env_name[TM_NAME_SIZE + 8];
+	char *envp[] = { env_model, env_attachment, env_name, NULL };
+	struct tm_wheel_response *response;
+	const struct tm_wheel_info *twi;
+	bool attachment_found, changed;
+	unsigned long flags;
+	int ret;
+
+	response = kzalloc(sizeof(*response), GFP_KERNEL);
+	if (!response)
+		return -ENOMEM;
+
+	ret = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0), model_request.bRequest,
+			      model_request.bRequestType, 0, 0, response, sizeof(*response),
+			      USB_CTRL_GET_TIMEOUT);
+	if (ret >= 0)
+		ret = thrustmaster_parse_response(&udev->dev, response, ret,
+						  &identity->model, &identity->attachment);
+	kfree(response);
+	if (ret)
+		return ret;
+
+	twi = thrustmaster_find_wheel(identity->model, identity->attachment, &attachment_found);
+	identity->name = twi ? twi->wheel_name : NULL;
+
+	spin_lock_irqsave(&tm_cache_lock, flags);
+	changed = thrustmaster_identity_update(udev, identity->model, identity->attachment);
+	spin_unlock_irqrestore(&tm_cache_lock, flags);
+
+	if (changed) {
+		snprintf(env_model, sizeof(env_model), "TM_MODEL=0x%02x", identity->model);
+		snprintf(env_attachment, sizeof(env_attachment), "TM_ATTACHMENT=0x%02x", identity->attachment);
+		snprintf(env_name, sizeof(env_name), "TM_NAME=%s", identity->name ? identity->name : "unknown");
+		kobject_uevent_env(&udev->dev.kobj, KOBJ_CHANGE, envp);
+	}
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(tminit_rescan);
+
+struct tm_rescan_match {
+	const char *key;
+	struct usb_device *udev;
+};
+
+// Takes a reference on the Thrustmaster device with the key of match
+static int thrustmaster_rescan_match(struct usb_device *udev, void *data)
+{
+	struct tm_rescan_match *match = data;
+
+	if (le16_to_cpu(udev->descriptor.idVendor) != 0x044f)
+		return 0;
+	if (strcmp(dev_name(&udev->dev), match->key) &&
+	    (!udev->serial || strcmp(udev->serial, match->key)))
+		return 0;
+
+	match->udev = usb_get_dev(udev);
+	return 1;
+}
+
+/*
+ * Writing the serial number or the port path of a wheel switched by this
+ * driver asks it for its model again through tminit_rescan(). Once switched
+ * the wheel is bound to another driver and the rescan attribute of the
+ * generic wheel is gone, this works however long ago the switch was.
+ */
+static ssize_t rescan_wheel_store(struct device_driver *drv, const char *buf, size_t count)
+{
+	struct tm_rescan_match match = {};
+	struct tminit_identity identity;
+	char key[TM_CACHE_KEY_SIZE];
+	unsigned long flags;
+	bool switched;
+	int ret;
+
+	if (strscpy(key, buf, sizeof(key)) < 0)
+		return -EINVAL;
+	match.key = strim(key);
+	if (!*match.key)
+		return -EINVAL;
+
+	usb_for_each_dev(&match, thrustmaster_rescan_match);
+	if (!match.udev)
+		return -ENODEV;
+
+	spin_lock_irqsave(&tm_cache_lock, flags);
+	switched = thrustmaster_identity_find(match.udev, false) != NULL;
+	spin_unlock_irqrestore(&tm_cache_lock, flags);
+
+	ret = switched ? tminit_rescan(match.udev, &identity) : -ENOENT;
+	usb_put_dev(match.udev);
+
+	return ret ? ret : count;
+}
+static DRIVER_ATTR_WO(rescan_wheel);
+
+/*
+ * Read only attributes of the hid device with the state of the init
+ */
+static ssize_t state_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(to_hid_device(dev));
+
+	return sysfs_emit(buf, "%s\n", tm_state_names[tm_wheel->state]);
+}
+static DEVICE_ATTR_RO(state);
+
+static ssize_t model_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(to_hid_device(dev));
+
+	if (!tm_wheel->identified)
+		return sysfs_emit(buf, "unknown\n");
+
+	return sysfs_emit(buf, "0x%02x\n", tm_wheel->model);
+}
+static DEVICE_ATTR_RO(model);
+
+static ssize_t attachment_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(to_hid_device(dev));
+
+	if (!tm_wheel->identified)
+		return sysfs_emit(buf, "unknown\n");
+
+	return sysfs_emit(buf, "0x%02x%s\n", tm_wheel->attachment,
+			  tm_wheel->attachment_found ? "" : " (not found)");
+}
+static DEVICE_ATTR_RO(attachment);
+
+static ssize_t wheel_name_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(to_hid_device(dev));
+
+	if (!tm_wheel->twi)
+		return sysfs_emit(buf, "unknown\n");
+
+	return sysfs_emit(buf, "%s\n", tm_wheel->twi->wheel_name);
+}
+static DEVICE_ATTR_RO(wheel_name);
+
+// Attribute showing _value, an expression of tm_wheel
+#define TM_ATTR_RO(_name, _fmt, _value)							\
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf)	\
+{											\
+	struct tm_wheel *tm_wheel = hid_get_drvdata(to_hid_device(dev));		\
+											\
+	return sysfs_emit(buf, _fmt "\n", _value);					\
+}											\
+static DEVICE_ATTR_RO(_name)
+
+TM_ATTR_RO(attempts, "%u", tm_wheel->attempts);
+TM_ATTR_RO(last_status, "%d", tm_wheel->last_status);
+TM_ATTR_RO(transfers_ok, "%u", tm_wheel->transfers_ok);
+TM_ATTR_RO(transfers_failed, "%u", tm_wheel->transfers_failed);
+TM_ATTR_RO(setup_usec, "%lld", div_s64(tm_wheel->phase_ns[TM_STATE_SETUP], NSEC_PER_USEC));
+TM_ATTR_RO(query_usec, "%lld", div_s64(tm_wheel->phase_ns[TM_STATE_QUERY_MODEL], NSEC_PER_USEC));
+TM_ATTR_RO(switch_usec, "%lld", div_s64(tm_wheel->phase_ns[TM_STATE_SWITCH], NSEC_PER_USEC));
+TM_ATTR_RO(total_usec, "%lld", div_s64(tm_wheel->total_ns, NSEC_PER_USEC));
+
+// Attribute to read and change the unsigned int field _name of tm_wheel
+#define TM_ATTR_UINT_RW(_name)								\
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf)	\
+{											\
+	struct tm_wheel *tm_wheel = hid_get_drvdata(to_hid_device(dev));		\
+											\
+	return sysfs_emit(buf, "%u\n", READ_ONCE(tm_wheel->_name));			\
+}											\
+static ssize_t _name##_store(struct device *dev, struct device_attribute *attr,	\
+			     const char *buf, size_t count)				\
+{											\
+	struct tm_wheel *tm_wheel = hid_get_drvdata(to_hid_device(dev));		\
+	unsigned int value;								\
+	int ret = kstrtouint(buf, 0, &value);						\
+											\
+	if (ret)									\
+		return ret;								\
+	WRITE_ONCE(tm_wheel->_name, value);						\
+	return count;									\
+}											\
+static DEVICE_ATTR_RW(_name)
+
+TM_ATTR_UINT_RW(setup_timeout_ms);
+TM_ATTR_UINT_RW(query_timeout_ms);
+TM_ATTR_UINT_RW(switch_timeout_ms);
+TM_ATTR_UINT_RW(phase_gap_ms);
+
+/*
+ * Writing 1 once the init is over asks the wheel for its model again and,
+ * if it is still in generic mode, switches it. The result is reported with
+ * the usual uevent, the one of the previous init is sent before restarting.
+ */
+static ssize_t rescan_store(struct device *dev, struct device_attribute *attr,
+			    const char *buf, size_t count)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(to_hid_device(dev));
+	bool rescan;
+	int ret = kstrtobool(buf, &rescan);
+
+	if (ret)
+		return ret;
+	if (!rescan)
+		return count;
+
+	mutex_lock(&tm_wheel->rescan_lock);
+	if (tm_wheel->state < TM_STATE_DONE || READ_ONCE(tm_wheel->suspended)) {
+		mutex_unlock(&tm_wheel->rescan_lock);
+		return -EBUSY;
+	}
+
+	// Once the init is over only these works may still use the wheel
+	flush_work(&tm_wheel->uevent_work);
+	flush_work(&tm_wheel->connect_work);
+
+	tm_wheel->twi = NULL;
+	tm_wheel->identified = false;
+	tm_wheel->from_cache = false;
+	thrustmaster_set_state(tm_wheel, TM_STATE_QUERY_MODEL);
+	tm_wheel->probe_time = ktime_get();
+	thrustmaster_queue_init(tm_wheel);
+	mutex_unlock(&tm_wheel->rescan_lock);
+
+	return count;
+}
+static DEVICE_ATTR_WO(rescan);
+
+static ssize_t priority_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(to_hid_device(dev));
+
+	return sysfs_emit(buf, "%d\n", READ_ONCE(tm_wheel->priority));
+}
+
+// If the wheel is waiting for an init slot it is moved to its new place
+static ssize_t priority_store(struct device *dev, struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(to_hid_device(dev));
+	unsigned long flags;
+	int priority;
+	int ret = kstrtoint(buf, 0, &priority);
+
+	if (ret)
+		return ret;
+
+	spin_lock_irqsave(&tm_inflight_lock, flags);
+	WRITE_ONCE(tm_wheel->priority, priority);
+	if (!list_empty(&tm_wheel->pending)) {
+		list_del(&tm_wheel->pending);
+		thrustmaster_pending_add(tm_wheel);
+	}
+	spin_unlock_irqrestore(&tm_inflight_lock, flags);
+
+	return count;
+}
+static DEVICE_ATTR_RW(priority);
+
+static struct attribute *thrustmaster_attrs[] = {
+	&dev_attr_state.attr,
+	&dev_attr_model.attr,
+	&dev_attr_attachment.attr,
+	&dev_attr_wheel_name.attr,
+	&dev_attr_attempts.attr,
+	&dev_attr_last_status.attr,
+	&dev_attr_transfers_ok.attr,
+	&dev_attr_transfers_failed.attr,
+	&dev_attr_setup_usec.attr,
+	&dev_attr_query_usec.attr,
+	&dev_attr_switch_usec.attr,
+	&dev_attr_total_usec.attr,
+	&dev_attr_setup_timeout_ms.attr,
+	&dev_attr_query_timeout_ms.attr,
+	&dev_attr_switch_timeout_ms.attr,
+	&dev_attr_phase_gap_ms.attr,
+	&dev_attr_rescan.attr,
+	&dev_attr_priority.attr,
+	NULL
+};
+
+static const struct attribute_group thrustmaster_group = {
+	.name = "tminit",
+	.attrs = thrustmaster_attrs,
+};
+
+/*
+ * How many of the wheels bound to the driver are done, still initializing or
+ * failed, one line per model. The wheels whose model is not known yet are
+ * counted as "unknown".
+ */
+static ssize_t summary_show(struct device_driver *drv, char *buf)
+{
+	struct tm_wheel *tm_wheel, *other;
+	unsigned int counts[3];
+	ssize_t len = 0;
+	bool seen;
+
+	mutex_lock(&tm_wheels_lock);
+	list_for_each_entry(tm_wheel, &tm_wheels, node) {
+		seen = false;
+		list_for_each_entry(other, &tm_wheels, node) {
+			if (other == tm_wheel)
+				break;
+			if (other->twi == tm_wheel->twi) {
+				seen = true;
+				break;
+			}
+		}
+		if (seen)
+			continue;
+
+		memset(counts, 0, sizeof(counts));
+		other = tm_wheel;
+		list_for_each_entry_from(other, &tm_wheels, node) {
+			if (other->twi != tm_wheel->twi)
+				continue;
+			if (other->state == TM_STATE_DONE)
+				counts[0]++;
+			else if (other->state == TM_STATE_FAILED)
+				counts[2]++;
+			else
+				counts[1]++;
+		}
+
+		len += sysfs_emit_at(buf, len, "%s: %u done, %u initializing, %u failed\n",
+				     tm_wheel->twi ? tm_wheel->twi->wheel_name : "unknown",
+				     counts[0], counts[1], counts[2]);
+	}
+	mutex_unlock(&tm_wheels_lock);
+
+	return len;
+}
+static DRIVER_ATTR_RO(summary);
+
+static const struct {
+	unsigned int usage;
+	unsigned int code;
+} tm_fast_axes_map[] = {
+	{ HID_GD_X, ABS_X },
+	{ HID_GD_Y, ABS_Y },
+	{ HID_GD_Z, ABS_Z },
+	{ HID_GD_RX, ABS_RX },
+	{ HID_GD_RY, ABS_RY },
+	{ HID_GD_RZ, ABS_RZ },
+	{ HID_GD_SLIDER, ABS_THROTTLE },
+	{ HID_GD_DIAL, ABS_RUDDER },
+};
+
+// Same as in hid-input, indexed by direction + 1, 0 when centered
+static const struct {
+	s8 x;
+	s8 y;
+} tm_hat_to_axis[] = {
+	{ 0, 0 }, { 0, -1 }, { 1, -1 }, { 1, 0 }, { 1, 1 }, { 0, 1 }, { -1, 1 }, { -1, 0 }, { -1, -1 }
+};
+
+/*
+ * Adds the value of usage index of field to what thrustmaster_raw_event()
+ * reports. Returns false if it can't be decoded.
+ */
+static bool thrustmaster_fast_add(struct tm_fast_input *fast, struct hid_field *field, unsigned int index)
+{
+	unsigned int usage = field->usage[index].hid;
+	struct tm_fast_value *value = NULL;
+	unsigned int i;
+
+	if ((usage & HID_USAGE_PAGE) == HID_UP_BUTTON) {
+		if (fast->buttons_count >= TM_FAST_MAX_BUTTONS)
+			return false;
+		value = &fast->buttons[fast->buttons_count];
+		value->code = fast->buttons_count < 16 ?
+			      BTN_JOYSTICK + fast->buttons_count :
+			      BTN_TRIGGER_HAPPY + fast->buttons_count - 16;
+		fast->buttons_count++;
+	} else if (usage == HID_GD_HATSWITCH) {
+		if (fast->has_hat || field->logical_maximum <= field->logical_minimum)
+			return false;
+		value = &fast->hat;
+		value->code = ABS_HAT0X;
+		fast->has_hat = true;
+	} else {
+		for (i = 0; i < ARRAY_SIZE(tm_fast_axes_map); i++)
+			if (tm_fast_axes_map[i].usage == usage)
+				break;
+		if (i == ARRAY_SIZE(tm_fast_axes_map) || fast->axes_count >= TM_FAST_MAX_AXES)
+			return false;
+		value = &fast->axes[fast->axes_count++];
+		value->code = tm_fast_axes_map[i].code;
+	}
+
+	value->offset = field->report_offset + index * field->report_size;
+	value->size = field->report_size;
+	value->minimum = field->logical_minimum;
+	value->maximum = field->logical_maximum;
+	return true;
+}
+
+/*
+ * Looks in the report descriptor for the input report with the wheel axis.
+ * hid-input is left out only if it is the only input report and every one of
+ * its fields, padding aside, can be decoded. Returns false otherwise.
+ */
+static bool thrustmaster_fast_discover(struct tm_fast_input *fast, struct hid_device *hdev)
+{
+	struct hid_report_enum *report_enum = &hdev->report_enum[HID_INPUT_REPORT];
+	struct hid_report *report;
+	struct hid_field *field;
+	unsigned int i, j;
+
+	if (!list_is_singular(&report_enum->report_list))
+		return false;
+
+	report = list_first_entry(&report_enum->report_list, struct hid_report, list);
+	for (i = 0; i < report->maxfield; i++) {
+		field = report->field[i];
+		if (field->flags & HID_MAIN_ITEM_CONSTANT)
+			continue;
+		if (!(field->flags & HID_MAIN_ITEM_VARIABLE) || field->report_size > 32)
+			goto unknown;
+		for (j = 0; j < field->maxusage && j < field->report_count; j++)
+			if (!thrustmaster_fast_add(fast, field, j))
+				goto unknown;
+	}
+
+	if (fast->axes_count && fast->axes[0].code == ABS_X) {
+		fast->report = report;
+		return true;
+	}
+
+unknown:
+	tm_dbg(hdev, "Input report not supported by fast_input, using hid-input\n");
+	memset(fast, 0, sizeof(*fast));
+	return false;
+}
+
+static int thrustmaster_fast_open(struct input_dev *input)
+{
+	return hid_hw_open(input_get_drvdata(input));
+}
+
+static void thrustmaster_fast_close(struct input_dev *input)
+{
+	hid_hw_close(input_get_drvdata(input));
+}
+
+static int thrustmaster_fast_register(struct tm_fast_input *fast, struct hid_device *hdev)
+{
+	struct input_dev *input;
+	unsigned int i;
+	int ret;
+
+	input = input_allocate_device();
+	if (!input)
+		return -ENOMEM;
+
+	input->name = hdev->name;
+	input->phys = hdev->phys;
+	input->uniq = hdev->uniq;
+	input->id.bustype = hdev->bus;
+	input->id.vendor = hdev->vendor;
+	input->id.product = hdev->product;
+	input->id.version = hdev->version;
+	input->dev.parent = &hdev->dev;
+	input->open = thrustmaster_fast_open;
+	input->close = thrustmaster_fast_close;
+	input_set_drvdata(input, hdev);
+
+	for (i = 0; i < fast->axes_count; i++)
+		input_set_abs_params(input, fast->axes[i].code,
+				     fast->axes[i].minimum, fast->axes[i].maximum, 0, 0);
+	for (i = 0; i < fast->buttons_count; i++)
+		input_set_capability(input, EV_KEY, fast->buttons[i].code);
+	if (fast->has_hat) {
+		input_set_abs_params(input, ABS_HAT0X, -1, 1, 0, 0);
+		input_set_abs_params(input, ABS_HAT0Y, -1, 1, 0, 0);
+	}
+
+	ret = input_register_device(input);
+	if (ret) {
+		input_free_device(input);
+		return ret;
+	}
+
+	WRITE_ONCE(fast->input, input);
+	return 0;
+}
+
+static s32 thrustmaster_fast_extract(struct hid_device *hdev, u8 *data, const struct tm_fast_value *value)
+{
+	u32 raw = hid_field_extract(hdev, data, value->offset, value->size);
+
+	return value->minimum < 0 ? sign_extend32(raw, value->size - 1) : (s32)raw;
+}
+
+static int thrustmaster_raw_event(struct hid_device *hdev, struct hid_report *report, u8 *data, int size)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+	struct tm_fast_input *fast;
+	struct input_dev *input;
+	struct tm_fast_value *value;
+	unsigned int i;
+	s32 hat;
+	int dir;
+
+	if (!tm_wheel)
+		return 0;
+
+	fast = &tm_wheel->fast;
+	input = READ_ONCE(fast->input);
+	if (!input || report != fast->report)
+		return 0;
+
+	if (report->id) {
+		data++;
+		size--;
+	}
+	if (size < DIV_ROUND_UP(report->size, 8))
+		return 0;
+
+	for (i = 0; i < fast->axes_count; i++) {
+		value = &fast->axes[i];
+		input_report_abs(input, value->code, thrustmaster_fast_extract(hdev, data, value));
+	}
+	for (i = 0; i < fast->buttons_count; i++) {
+		value = &fast->buttons[i];
+		input_report_key(input, value->code, hid_field_extract(hdev, data, value->offset, 1));
+	}
+	if (fast->has_hat) {
+		// Out of the logical range, the null state, is centered
+		value = &fast->hat;
+		hat = thrustmaster_fast_extract(hdev, data, value);
+		dir = hat < value->minimum || hat > value->maximum ? 0 :
+		      (hat - value->minimum) * 8 / (value->maximum - value->minimum + 1) + 1;
+		input_report_abs(input, ABS_HAT0X, tm_hat_to_axis[dir].x);
+		input_report_abs(input, ABS_HAT0Y, tm_hat_to_axis[dir].y);
+	}
+	input_sync(input);
 
-	char const *const wheel_name;
-};
+	return 0;
+}
 
-/*
- * Known wheels.
- * Note: TMX does not work as it requires 2 control packets
- */
-static const struct tm_wheel_info tm_wheels_infos[] = {
-	{0x00, 0x02, 0x0002, "Thrustmaster T500RS"},
-	{0x02, 0x00, 0x0005, "Thrustmaster T300RS (Missing Attachment)"},
-	{0x02, 0x03, 0x0005, "Thrustmaster T300RS (F1 attachment)"},
-	{0x02, 0x04, 0x0005, "Thrustmaster T300 Ferrari Alcantara Edition"},
-	{0x02, 0x06, 0x0005, "Thrustmaster T300RS"},
-	{0x02, 0x09, 0x0005, "Thrustmaster T300RS (Open Wheel Attachment)"},
-	{0x03, 0x06, 0x0006, "Thrustmaster T150RS"},
-	{0x00, 0x09, 0x000b, "Thrustmaster T128"}
-	//{0x04, 0x07, 0x0001, "Thrustmaster TMX"}
-};
+static struct dentry *tm_debugfs_dir;
+
+static int thrustmaster_bench_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Fills stats with the min, median and 99th percentile of samples
+static void thrustmaster_bench_stats(u64 *samples, unsigned int count, u64 stats[3])
+{
+	sort(samples, count, sizeof(*samples), thrustmaster_bench_cmp, NULL);
+	stats[0] = samples[0];
+	stats[1] = samples[count / 2];
+	stats[2] = samples[min(count - 1, DIV_ROUND_UP(count * 99, 100) - 1)];
+}
 
-static const uint8_t tm_wheels_infos_length = 8;
+static int thrustmaster_bench_show(struct seq_file *m, void *data)
+{
+	struct tm_wheel *tm_wheel = m->private;
+
+	seq_printf(m, "iterations: %u\n", tm_wheel->bench_count);
+	seq_printf(m, "errors: %u\n", tm_wheel->bench_errors);
+	seq_puts(m, "phase: min_usec median_usec p99_usec\n");
+	seq_printf(m, "setup: %llu %llu %llu\n", div_u64(tm_wheel->bench_setup_ns[0], NSEC_PER_USEC),
+		   div_u64(tm_wheel->bench_setup_ns[1], NSEC_PER_USEC),
+		   div_u64(tm_wheel->bench_setup_ns[2], NSEC_PER_USEC));
+	seq_printf(m, "query: %llu %llu %llu\n", div_u64(tm_wheel->bench_query_ns[0], NSEC_PER_USEC),
+		   div_u64(tm_wheel->bench_query_ns[1], NSEC_PER_USEC),
+		   div_u64(tm_wheel->bench_query_ns[2], NSEC_PER_USEC));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(thrustmaster_bench);
 
 /*
- * This structs contains (in little endian) the response data
- * of the wheel to the request 73
- *
- * A sufficient research to understand what each field does is not
- * beign conducted yet. The position and meaning of fields are a
- * just a very optimistic guess based on instinct....
+ * Times bench_iterations rounds of the setup interrupts and of the model
+ * request, without switching the wheel. The transfers are synchronous, it
+ * runs from thrustmaster_work() before the init. The results are shown in
+ * debugfs, in hid-tminit/<hid device>.
  */
-struct __packed tm_wheel_response
+static void thrustmaster_bench(struct tm_wheel *tm_wheel)
 {
-	/*
-	 * Seems to be the type of packet
-	 * - 0x0049 if is data.a (15 bytes)
-	 * - 0x0047 if is data.b (7 bytes)
-	 */
-	uint16_t type;
+	struct hid_device *hdev = tm_wheel->hdev;
+	struct usb_device *udev = tm_wheel->usb_dev;
+	struct usb_host_endpoint *ep = tm_wheel->int_ep;
+	unsigned int count = min_t(unsigned int, bench_iterations, TM_BENCH_MAX_ITERATIONS);
+	unsigned int i, j, setup_count = 0;
+	u64 *setup_samples, *query_samples;
+	u8 *setup_buf, *response;
+	int ret = 0, actual;
+	ktime_t start;
 
-	union {
-		struct __packed {
-			uint16_t field0;
-			uint16_t field1;
-			/*
-			 * Seems to be the model code of the wheel
-			 * Read table thrustmaster_wheels to values
-			 */
-			uint8_t attachment;
-			uint8_t model;
+	tm_wheel->bench_done = true;
 
-			uint16_t field2;
-			uint16_t field3;
-			uint16_t field4;
-			uint16_t field5;
-		} a;
-		struct __packed {
-			uint16_t field0;
-			uint16_t field1;
-			uint8_t attachment;
-			uint8_t model;
-		} b;
-	} data;
-};
+	setup_samples = kcalloc(count, sizeof(*setup_samples), GFP_KERNEL);
+	query_samples = kcalloc(count, sizeof(*query_samples), GFP_KERNEL);
+	setup_buf = kmalloc(TM_SETUP_MAX_SIZE, GFP_KERNEL);
+	response = kmalloc(sizeof(struct tm_wheel_response), GFP_KERNEL);
+	if (!setup_samples || !query_samples || !setup_buf || !response)
+		goto out;
 
-struct tm_wheel {
-	struct usb_device *usb_dev;
-	struct urb *urb;
+	for (i = 0; i < count; i++) {
+		if (ep) {
+			start = ktime_get();
+			for (j = 0; j < ARRAY_SIZE(setup_arr); j++) {
+				memcpy(setup_buf, setup_arr[j], setup_arr_sizes[j]);
+				ret = usb_interrupt_msg(udev, usb_sndintpipe(udev, ep->desc.bEndpointAddress),
+							setup_buf, setup_arr_sizes[j], &actual,
+							READ_ONCE(tm_wheel->setup_timeout_ms));
+				if (ret)
+					break;
+			}
+			if (ret)
+				tm_wheel->bench_errors++;
+			else
+				setup_samples[setup_count++] = ktime_to_ns(ktime_sub(ktime_get(), start));
+			if (ret == -ENODEV || ret == -ESHUTDOWN)
+				break;
+		}
 
-	struct usb_ctrlrequest *model_request;
-	struct tm_wheel_response *response;
+		start = ktime_get();
+		ret = usb_control_msg(udev, usb_rcvctrlpipe(udev, 0), model_request.bRequest,
+				      model_request.bRequestType, 0, 0, response,
+				      sizeof(struct tm_wheel_response), READ_ONCE(tm_wheel->query_timeout_ms));
+		if (ret < 0) {
+			tm_wheel->bench_errors++;
+			if (ret == -ENODEV || ret == -ESHUTDOWN)
+				break;
+			continue;
+		}
+		query_samples[tm_wheel->bench_count++] = ktime_to_ns(ktime_sub(ktime_get(), start));
+	}
 
-	struct usb_ctrlrequest *change_request;
-};
+	if (setup_count)
+		thrustmaster_bench_stats(setup_samples, setup_count, tm_wheel->bench_setup_ns);
+	if (tm_wheel->bench_count)
+		thrustmaster_bench_stats(query_samples, tm_wheel->bench_count, tm_wheel->bench_query_ns);
 
-/* The control packet to send to wheel */
-static const struct usb_ctrlrequest model_request = {
-	.bRequestType = 0xc1,
-	.bRequest = 73,
-	.wValue = 0,
-	.wIndex = 0,
-	.wLength = cpu_to_le16(0x0010)
-};
+	tm_wheel->bench_file = debugfs_create_file(dev_name(&hdev->dev), 0444, tm_debugfs_dir,
+						   tm_wheel, &thrustmaster_bench_fops);
+	tm_dbg(hdev, "Benchmark done, %u model requests timed with %u errors\n",
+	       tm_wheel->bench_count, tm_wheel->bench_errors);
 
-static const struct usb_ctrlrequest change_request = {
-	.bRequestType = 0x41,
-	.bRequest = 83,
-	.wValue = 0, // Will be filled by the driver
-	.wIndex = 0,
-	.wLength = 0
-};
+out:
+	kfree(response);
+	kfree(setup_buf);
+	kfree(query_samples);
+	kfree(setup_samples);
+}
 
 /*
- * On some setups initializing the T300RS crashes the kernel,
- * these interrupts fix that particular issue. So far they haven't caused any
- * adverse effects in other wheels.
+ * Connects the generic wheel to hid-input and hidraw, or to the fast input
+ * device, after a quiet probe
  */
-static void thrustmaster_interrupts(struct hid_device *hdev)
+static void thrustmaster_connect_work(struct work_struct *work)
 {
-	int ret, trans, i, b_ep;
-	u8 *send_buf = kmalloc(256, GFP_KERNEL);
-	struct usb_host_endpoint *ep;
-	struct device *dev = &hdev->dev;
-	struct usb_interface *usbif = to_usb_interface(dev->parent);
-	struct usb_device *usbdev = interface_to_usbdev(usbif);
+	struct tm_wheel *tm_wheel = container_of(work, struct tm_wheel, connect_work);
+	struct hid_device *hdev = tm_wheel->hdev;
+	int ret;
 
-	if (!send_buf) {
-		hid_err(hdev, "failed allocating send buffer\n");
+	if (!tm_wheel->quiet)
 		return;
+	tm_wheel->quiet = false;
+
+	ret = hid_connect(hdev, tm_wheel->connect_mask);
+	if (ret)
+		hid_err(hdev, "failed connecting the generic wheel, error %d\n", ret);
+
+	if (tm_wheel->fast.report) {
+		ret = thrustmaster_fast_register(&tm_wheel->fast, hdev);
+		if (ret)
+			hid_err(hdev, "failed registering the fast input device, error %d\n", ret);
 	}
+}
 
-	if (usbif->cur_altsetting->desc.bNumEndpoints < 2) {
-		kfree(send_buf);
-		hid_err(hdev, "Wrong number of endpoints?\n");
-		return;
+/*
+ * Sends a KOBJ_CHANGE uevent for the hid device once the init is over, with
+ * TM_INIT_RESULT=done or failed, TM_INIT_USEC and what is known of the wheel:
+ * TM_MODEL, TM_ATTACHMENT and TM_NAME
+ */
+static void thrustmaster_uevent_work(struct work_struct *work)
+{
+	struct tm_wheel *tm_wheel = container_of(work, struct tm_wheel, uevent_work);
+	char result[32], usec[32], model[16], attachment[32], name[TM_NAME_SIZE + 8];
+	char *envp[6] = { result, usec };
+	int i = 2;
+
+	snprintf(result, sizeof(result), "TM_INIT_RESULT=%s", tm_state_names[tm_wheel->state]);
+	snprintf(usec, sizeof(usec), "TM_INIT_USEC=%lld", div_s64(tm_wheel->total_ns, NSEC_PER_USEC));
+	if (tm_wheel->identified) {
+		snprintf(model, sizeof(model), "TM_MODEL=0x%02x", tm_wheel->model);
+		snprintf(attachment, sizeof(attachment), "TM_ATTACHMENT=0x%02x", tm_wheel->attachment);
+		envp[i++] = model;
+		envp[i++] = attachment;
+	}
+	if (tm_wheel->twi) {
+		snprintf(name, sizeof(name), "TM_NAME=%s", tm_wheel->twi->wheel_name);
+		envp[i++] = name;
 	}
+	envp[i] = NULL;
 
-	ep = &usbif->cur_altsetting->endpoint[1];
-	b_ep = ep->desc.bEndpointAddress;
+	kobject_uevent_env(&tm_wheel->hdev->dev.kobj, KOBJ_CHANGE, envp);
+}
 
-	for (i = 0; i < ARRAY_SIZE(setup_arr); ++i) {
-		memcpy(send_buf, setup_arr[i], setup_arr_sizes[i]);
+/*
+ * Whether the probe can be quiet, see quiet_probe
+ */
+static bool thrustmaster_quiet_probe(struct usb_device *udev)
+{
+	uint8_t model, attachment;
+	bool attachment_found;
 
-		ret = usb_interrupt_msg(usbdev,
-			usb_sndintpipe(usbdev, b_ep),
-			send_buf,
-			setup_arr_sizes[i],
-			&trans,
-			USB_CTRL_SET_TIMEOUT);
+	if (quiet_probe >= 0)
+		return quiet_probe > 0;
 
-		if (ret) {
-			hid_err(hdev, "setup data couldn't be sent\n");
-			kfree(send_buf);
-			return;
-		}
-	}
+	return thrustmaster_cache_lookup(udev, &model, &attachment) &&
+	       thrustmaster_find_wheel(model, attachment, &attachment_found);
+}
+
+// Frees the URBs and the coherent buffers of the wheel
+static void thrustmaster_free_urbs(struct tm_wheel *tm_wheel)
+{
+	int i;
 
-	kfree(send_buf);
+	for (i = 0; i < ARRAY_SIZE(setup_arr); ++i)
+		usb_free_urb(tm_wheel->setup_urbs[i]);
+	usb_free_urb(tm_wheel->urb);
+	usb_free_coherent(tm_wheel->usb_dev, sizeof(*tm_wheel->bufs), tm_wheel->bufs, tm_wheel->bufs_dma);
 }
 
-static void thrustmaster_change_handler(struct urb *urb)
+static int thrustmaster_alloc_urbs(struct tm_wheel *tm_wheel)
 {
-	struct hid_device *hdev = urb->context;
+	int i;
 
-	// The wheel seems to kill himself before answering the host and therefore is violating the USB protocol...
-	if (urb->status == 0 || urb->status == -EPROTO || urb->status == -EPIPE)
-		hid_info(hdev, "Success?! The wheel should have been initialized!\n");
-	else
-		hid_warn(hdev, "URB to change wheel mode seems to have failed with error %d\n", urb->status);
+	tm_wheel->urb = usb_alloc_urb(0, GFP_KERNEL);
+	if (!tm_wheel->urb)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(setup_arr); ++i) {
+		tm_wheel->setup_urbs[i] = usb_alloc_urb(0, GFP_KERNEL);
+		if (!tm_wheel->setup_urbs[i]) {
+			thrustmaster_free_urbs(tm_wheel);
+			return -ENOMEM;
+		}
+	}
+
+	tm_wheel->bufs = usb_alloc_coherent(tm_wheel->usb_dev, sizeof(*tm_wheel->bufs), GFP_KERNEL,
+					    &tm_wheel->bufs_dma);
+	if (!tm_wheel->bufs) {
+		thrustmaster_free_urbs(tm_wheel);
+		return -ENOMEM;
+	}
+
+	BUILD_BUG_ON(ARRAY_SIZE(setup_1) > TM_SETUP_MAX_SIZE ||
+		     ARRAY_SIZE(setup_2) > TM_SETUP_MAX_SIZE ||
+		     ARRAY_SIZE(setup_3) > TM_SETUP_MAX_SIZE ||
+		     ARRAY_SIZE(setup_4) > TM_SETUP_MAX_SIZE);
+
+	memset(tm_wheel->bufs, 0, sizeof(*tm_wheel->bufs));
+	for (i = 0; i < ARRAY_SIZE(setup_arr); ++i)
+		memcpy(tm_wheel->bufs->setup_bufs[i], setup_arr[i], setup_arr_sizes[i]);
+
+	return 0;
 }
 
+#ifdef CONFIG_PM
 /*
- * Called by the USB subsystem when the wheel responses to our request
- * to get [what it seems to be] the wheel's model.
- *
- * If the model id is recognized then we send an opportune USB CONTROL REQUEST
- * to switch the wheel to its full capabilities
+ * Stops the init, it is resumed by thrustmaster_resume() or, if the wheel has
+ * been reset in the meanwhile, restarted by thrustmaster_reset_resume()
  */
-static void thrustmaster_model_handler(struct urb *urb)
+static int thrustmaster_suspend(struct hid_device *hdev, pm_message_t message)
 {
-	struct hid_device *hdev = urb->context;
 	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
-	uint8_t model = 0;
-	uint8_t attachment = 0;
-	uint8_t attachment_found;
-	int i, ret;
-	const struct tm_wheel_info *twi = NULL;
 
-	if (urb->status) {
-		hid_err(hdev, "URB to get model id failed with error %d\n", urb->status);
-		return;
-	}
+	WRITE_ONCE(tm_wheel->suspended, true);
+	cancel_delayed_work_sync(&tm_wheel->work);
+	// Once it has seen suspended, complete_work doesn't submit anything
+	cancel_work_sync(&tm_wheel->complete_work);
 
-	if (tm_wheel->response->type == cpu_to_le16(0x49)) {
-		model = tm_wheel->response->data.a.model;
-		attachment = tm_wheel->response->data.a.attachment;
-	} else if (tm_wheel->response->type == cpu_to_le16(0x47)) {
-		model = tm_wheel->response->data.b.model;
-		attachment = tm_wheel->response->data.b.attachment;
-	} else {
-		hid_err(hdev, "Unknown packet type 0x%x, unable to proceed further with wheel init\n", tm_wheel->response->type);
-		return;
-	}
+	// Also kills the next URB of the setup chain, if one is submitted meanwhile
+	usb_kill_anchored_urbs(&tm_wheel->anchor);
+	cancel_delayed_work_sync(&tm_wheel->timeout_work);
+	// Drops the outcome of a transfer completed just before being killed
+	cancel_work_sync(&tm_wheel->complete_work);
+	// Last, the check of a stale tm_cache entry may have queued the wheel again
+	thrustmaster_release_slot(tm_wheel);
 
-	for (i = 0; i < tm_wheels_infos_length && !twi; i++)
-		if (tm_wheels_infos[i].model == model)
-			twi = tm_wheels_infos + i;
+	return 0;
+}
 
-	if (twi) {
-		// Trying to find the best attachment
-		for (attachment_found = twi->attachment == attachment; !attachment_found && i < tm_wheels_infos_length && tm_wheels_infos[i].model == model; i++)
-			if (tm_wheels_infos[i].attachment == attachment) {
-				twi = tm_wheels_infos + i;
-				attachment_found = 1;
-			}
+/*
+ * The wheel kept its state, the interrupted phase is started again
+ */
+static int thrustmaster_resume(struct hid_device *hdev)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
 
-		hid_info(hdev, "Wheel with (model, attachment) = (0x%x, 0x%x) is a %s. attachment_found=%u\n", model, attachment, twi->wheel_name, attachment_found);
-	} else {
-		hid_err(hdev, "Unknown wheel's model id 0x%x, unable to proceed further with wheel init\n", model);
-		return;
+	WRITE_ONCE(tm_wheel->suspended, false);
+	if (tm_wheel->state < TM_STATE_DONE) {
+		tm_wheel->retries = 0;
+		thrustmaster_queue_init(tm_wheel);
 	}
 
-	tm_wheel->change_request->wValue = cpu_to_le16(twi->switch_value);
-	usb_fill_control_urb(
-		tm_wheel->urb,
-		tm_wheel->usb_dev,
-		usb_sndctrlpipe(tm_wheel->usb_dev, 0),
-		(char *)tm_wheel->change_request,
-		NULL, 0, // We do not expect any response from the wheel
-		thrustmaster_change_handler,
-		hdev
-	);
+	return 0;
+}
 
-	ret = usb_submit_urb(tm_wheel->urb, GFP_ATOMIC);
-	if (ret)
-		hid_err(hdev, "Error %d while submitting the change URB. I am unable to initialize this wheel...\n", ret);
+/*
+ * The wheel has been reset and is back in generic mode. If its model is
+ * already known only the switch is sent again, otherwise the whole init.
+ */
+static int thrustmaster_reset_resume(struct hid_device *hdev)
+{
+	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+
+	WRITE_ONCE(tm_wheel->suspended, false);
+	thrustmaster_set_state(tm_wheel, TM_STATE_SETUP);
+	tm_wheel->probe_time = ktime_get();
+	thrustmaster_queue_init(tm_wheel);
+
+	return 0;
 }
+#endif
 
 static void thrustmaster_remove(struct hid_device *hdev)
 {
 	struct tm_wheel *tm_wheel = hid_get_drvdata(hdev);
+	struct input_dev *input;
 
-	usb_kill_urb(tm_wheel->urb);
+	mutex_lock(&tm_wheels_lock);
+	list_del(&tm_wheel->node);
+	mutex_unlock(&tm_wheels_lock);
+	sysfs_remove_group(&hdev->dev.kobj, &thrustmaster_group);
 
-	kfree(tm_wheel->change_request);
-	kfree(tm_wheel->response);
-	kfree(tm_wheel->model_request);
-	usb_free_urb(tm_wheel->urb);
-	kfree(tm_wheel);
+	// Once out of tm_pending nobody else can schedule the work
+	thrustmaster_release_slot(tm_wheel);
+
+	/*
+	 * Once the anchor is poisoned no URB of the wheel can be submitted
+	 * again, whether it is in flight or not, so after this neither a
+	 * completion nor the works can start a new transfer. The processing
+	 * of a completion may still schedule a retry, cancel it last.
+	 */
+	usb_poison_anchored_urbs(&tm_wheel->anchor);
+	cancel_delayed_work_sync(&tm_wheel->timeout_work);
+	cancel_work_sync(&tm_wheel->complete_work);
+	// A stale tm_cache entry found by the check may have queued the wheel again
+	thrustmaster_release_slot(tm_wheel);
+	cancel_delayed_work_sync(&tm_wheel->work);
+	// Queued by a failure in the works
+	cancel_work_sync(&tm_wheel->connect_work);
+	/*
+	 * A wheel switched using tm_cache often leaves before answering the
+	 * check, its model request is then killed without a completion
+	 */
+	if (tm_wheel->state == TM_STATE_VERIFY)
+		thrustmaster_set_state(tm_wheel, TM_STATE_DONE);
+	// The wheel is most likely going away because it has just been switched
+	flush_work(&tm_wheel->uevent_work);
+	debugfs_remove(tm_wheel->bench_file);
 
+	/*
+	 * raw_event uses the fast input until hid_hw_stop() has killed the
+	 * input reports, it is only unregistered after that
+	 */
+	input = READ_ONCE(tm_wheel->fast.input);
+	WRITE_ONCE(tm_wheel->fast.input, NULL);
 	hid_hw_stop(hdev);
+
+	if (input)
+		input_unregister_device(input);
+	thrustmaster_free_urbs(tm_wheel);
 }
 
 /*
@@ -297,6 +2849,7 @@ static int thrustmaster_probe(struct hid_device *hdev, const struct hid_device_i
 {
 	int ret = 0;
 	struct tm_wheel *tm_wheel = NULL;
+	struct usb_interface *usbif;
 
 	if (!hid_is_usb(hdev))
 		return -EINVAL;
@@ -307,76 +2860,79 @@ static int thrustmaster_probe(struct hid_device *hdev, const struct hid_device_i
 		goto error0;
 	}
 
-	ret = hid_hw_start(hdev, HID_CONNECT_DEFAULT & ~HID_CONNECT_FF);
-	if (ret) {
-		hid_err(hdev, "hw start failed with error %d\n", ret);
-		goto error0;
-	}
-
-	// Now we allocate the tm_wheel
-	tm_wheel = kzalloc(sizeof(struct tm_wheel), GFP_KERNEL);
+	// Everything but the URBs lives in tm_wheel, freed along with hdev
+	tm_wheel = devm_kzalloc(&hdev->dev, sizeof(*tm_wheel), GFP_KERNEL);
 	if (!tm_wheel) {
 		ret = -ENOMEM;
-		goto error1;
+		goto error0;
 	}
 
-	tm_wheel->urb = usb_alloc_urb(0, GFP_ATOMIC);
-	if (!tm_wheel->urb) {
-		ret = -ENOMEM;
-		goto error2;
-	}
+	tm_wheel->hdev = hdev;
+	usbif = to_usb_interface(hdev->dev.parent);
+	tm_wheel->usb_dev = interface_to_usbdev(usbif);
 
-	tm_wheel->model_request = kmemdup(&model_request,
-					  sizeof(struct usb_ctrlrequest),
-					  GFP_KERNEL);
-	if (!tm_wheel->model_request) {
-		ret = -ENOMEM;
-		goto error3;
-	}
+	tm_wheel->connect_mask = HID_CONNECT_DEFAULT & ~HID_CONNECT_FF;
+	// The input reports are decoded by thrustmaster_raw_event() instead
+	if (fast_input && thrustmaster_fast_discover(&tm_wheel->fast, hdev))
+		tm_wheel->connect_mask &= ~HID_CONNECT_HIDINPUT;
 
-	tm_wheel->response = kzalloc(sizeof(struct tm_wheel_response), GFP_KERNEL);
-	if (!tm_wheel->response) {
-		ret = -ENOMEM;
-		goto error4;
-	}
+	// Only the driver, the wheel will most likely be switched right away
+	tm_wheel->quiet = thrustmaster_quiet_probe(tm_wheel->usb_dev);
+	INIT_WORK(&tm_wheel->connect_work, thrustmaster_connect_work);
+	INIT_WORK(&tm_wheel->uevent_work, thrustmaster_uevent_work);
+	mutex_init(&tm_wheel->rescan_lock);
 
-	tm_wheel->change_request = kmemdup(&change_request,
-					   sizeof(struct usb_ctrlrequest),
-					   GFP_KERNEL);
-	if (!tm_wheel->change_request) {
-		ret = -ENOMEM;
-		goto error5;
+	ret = hid_hw_start(hdev, tm_wheel->quiet ? HID_CONNECT_DRIVER : tm_wheel->connect_mask);
+	if (ret) {
+		hid_err(hdev, "hw start failed with error %d\n", ret);
+		goto error0;
 	}
 
-	tm_wheel->usb_dev = interface_to_usbdev(to_usb_interface(hdev->dev.parent));
-	hid_set_drvdata(hdev, tm_wheel);
+	ret = thrustmaster_alloc_urbs(tm_wheel);
+	if (ret)
+		goto error1;
 
-	thrustmaster_interrupts(hdev);
+	tm_wheel->change_request = change_request;
 
-	usb_fill_control_urb(
-		tm_wheel->urb,
-		tm_wheel->usb_dev,
-		usb_rcvctrlpipe(tm_wheel->usb_dev, 0),
-		(char *)tm_wheel->model_request,
-		tm_wheel->response,
-		sizeof(struct tm_wheel_response),
-		thrustmaster_model_handler,
-		hdev
-	);
+	if (usbif->cur_altsetting->desc.bNumEndpoints >= 2)
+		tm_wheel->int_ep = &usbif->cur_altsetting->endpoint[1];
+	tm_wheel->state = TM_STATE_SETUP;
+	tm_wheel->probe_time = ktime_get();
+	init_usb_anchor(&tm_wheel->anchor);
+	INIT_DELAYED_WORK(&tm_wheel->work, thrustmaster_work);
+	INIT_WORK(&tm_wheel->complete_work, thrustmaster_complete_work);
+	INIT_DELAYED_WORK(&tm_wheel->timeout_work, thrustmaster_timeout_work);
+	spin_lock_init(&tm_wheel->timeout_lock);
+	tm_wheel->setup_timeout_ms = setup_timeout_ms;
+	tm_wheel->query_timeout_ms = query_timeout_ms;
+	tm_wheel->switch_timeout_ms = switch_timeout_ms;
+	tm_wheel->phase_gap_ms = phase_gap_ms;
+	INIT_LIST_HEAD(&tm_wheel->pending);
+	tm_wheel->priority = thrustmaster_priority(tm_wheel->usb_dev);
+	hid_set_drvdata(hdev, tm_wheel);
 
-	ret = usb_submit_urb(tm_wheel->urb, GFP_ATOMIC);
+	ret = sysfs_create_group(&hdev->dev.kobj, &thrustmaster_group);
 	if (ret) {
-		hid_err(hdev, "Error %d while submitting the URB. I am unable to initialize this wheel...\n", ret);
-		goto error6;
+		hid_err(hdev, "failed creating the sysfs attributes, error %d\n", ret);
+		goto error2;
 	}
 
-	return ret;
+	mutex_lock(&tm_wheels_lock);
+	list_add_tail(&tm_wheel->node, &tm_wheels);
+	mutex_unlock(&tm_wheels_lock);
 
-error6: kfree(tm_wheel->change_request);
-error5: kfree(tm_wheel->response);
-error4: kfree(tm_wheel->model_request);
-error3: usb_free_urb(tm_wheel->urb);
-error2: kfree(tm_wheel);
+	if (tm_wheel->fast.report && !tm_wheel->quiet) {
+		ret = thrustmaster_fast_register(&tm_wheel->fast, hdev);
+		if (ret)
+			hid_err(hdev, "failed registering the fast input device, error %d\n", ret);
+	}
+
+	// The init goes on in thrustmaster_work(), failures there are retried
+	thrustmaster_queue_init(tm_wheel);
+
+	return 0;
+
+error2: thrustmaster_free_urbs(tm_wheel);
 error1: hid_hw_stop(hdev);
 error0:
 	return ret;
@@ -396,11 +2952,115 @@ static struct hid_driver thrustmaster_driver = {
 	.id_table = thrustmaster_devices,
 	.probe = thrustmaster_probe,
 	.remove = thrustmaster_remove,
+	.raw_event = thrustmaster_raw_event,
+#ifdef CONFIG_PM
+	.suspend = thrustmaster_suspend,
+	.resume = thrustmaster_resume,
+	.reset_resume = thrustmaster_reset_resume,
+#endif
 };
 
-module_hid_driver(thrustmaster_driver);
+static int __init thrustmaster_init(void)
+{
+	int ret;
+
+	if (!thrustmaster_wheels_sorted()) {
+		pr_err("tm_wheels_infos[] is not sorted by (model, attachment)\n");
+		return -EINVAL;
+	}
+
+	ret = thrustmaster_db_init();
+	if (ret)
+		goto error_db;
+
+	tm_model_request = kmemdup(&model_request, sizeof(model_request), GFP_KERNEL);
+	if (!tm_model_request) {
+		ret = -ENOMEM;
+		goto error_db;
+	}
+
+	tm_debugfs_dir = debugfs_create_dir("hid-tminit", NULL);
+
+	tm_wq = alloc_workqueue("hid-tminit", WQ_UNBOUND | WQ_HIGHPRI, 0);
+	if (!tm_wq) {
+		ret = -ENOMEM;
+		goto error_request;
+	}
+
+	if (model_cache && thrustmaster_cache_parse(model_cache))
+		pr_warn("model_cache is malformed, only the entries before the error are used\n");
+
+	ret = hid_register_driver(&thrustmaster_driver);
+	if (ret)
+		goto error0;
+
+	ret = driver_create_file(&thrustmaster_driver.driver, &driver_attr_model_cache);
+	if (ret)
+		goto error1;
+
+	ret = driver_create_file(&thrustmaster_driver.driver, &driver_attr_new_wheel);
+	if (ret)
+		goto error2;
+
+	ret = driver_create_file(&thrustmaster_driver.driver, &driver_attr_wheels);
+	if (ret)
+		goto error3;
+
+	ret = driver_create_file(&thrustmaster_driver.driver, &driver_attr_summary);
+	if (ret)
+		goto error4;
+
+	ret = driver_create_file(&thrustmaster_driver.driver, &driver_attr_identities);
+	if (ret)
+		goto error5;
+
+	ret = driver_create_file(&thrustmaster_driver.driver, &driver_attr_rescan_wheel);
+	if (ret)
+		goto error6;
+
+	return 0;
+
+error6: driver_remove_file(&thrustmaster_driver.driver, &driver_attr_identities);
+error5: driver_remove_file(&thrustmaster_driver.driver, &driver_attr_summary);
+error4: driver_remove_file(&thrustmaster_driver.driver, &driver_attr_wheels);
+error3: driver_remove_file(&thrustmaster_driver.driver, &driver_attr_new_wheel);
+error2: driver_remove_file(&thrustmaster_driver.driver, &driver_attr_model_cache);
+error1: hid_unregister_driver(&thrustmaster_driver);
+error0: destroy_workqueue(tm_wq);
+error_request:
+	debugfs_remove_recursive(tm_debugfs_dir);
+	kfree(tm_model_request);
+error_db:
+	thrustmaster_db_free();
+	return ret;
+}
+
+static void __exit thrustmaster_exit(void)
+{
+	driver_remove_file(&thrustmaster_driver.driver, &driver_attr_rescan_wheel);
+	driver_remove_file(&thrustmaster_driver.driver, &driver_attr_identities);
+	driver_remove_file(&thrustmaster_driver.driver, &driver_attr_summary);
+	driver_remove_file(&thrustmaster_driver.driver, &driver_attr_wheels);
+	driver_remove_file(&thrustmaster_driver.driver, &driver_attr_new_wheel);
+	driver_remove_file(&thrustmaster_driver.driver, &driver_attr_model_cache);
+	hid_unregister_driver(&thrustmaster_driver);
+	destroy_workqueue(tm_wq);
+	debugfs_remove_recursive(tm_debugfs_dir);
+	kfree(tm_model_request);
+	// Pending kfree_rcu() of old versions of tm_db
+	rcu_barrier();
+	thrustmaster_db_free();
+}
+
+module_init(thrustmaster_init);
+module_exit(thrustmaster_exit);
 
 MODULE_AUTHOR("Dario Pagani <dario.pagani.146+linuxk@gmail.com>");
 MODULE_LICENSE("GPL");
 MODULE_DESCRIPTION("Driver to initialize some steering wheel joysticks from Thrustmaster");
 
+// Only in test builds, see the Makefile
+#if IS_ENABLED(CONFIG_HID_TMINIT_KUNIT_TEST)
+#include "hid-tminit-test.c"
+#endif
+
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Interface of hid-tminit for the drivers of the Thrustmaster wheels after
+ * the switch, like hid-tmff2.
+ *
+ * When switched, the wheel disconnects and comes back with a new product id
+ * on the same port and, if it has one, with the same serial number.
+ * Its driver can get from hid-tminit what has been detected instead of
+ * asking the wheel again.
+ */
+#ifndef _HID_TMINIT_H
+#define _HID_TMINIT_H
+
+#include <linux/types.h>
+
+struct usb_device;
+
+struct tminit_identity {
+	u8 model;
+	u8 attachment;
+	// Name of the wheel, NULL if the model is no longer known
+	const char *name;
+	// Time it took from the probe of the generic wheel to the switch
+	u64 init_ns;
+	// Value of jiffies when the wheel has been switched
+	unsigned long switched_at;
+};
+
+/*
+ * Fills identity with what hid-tminit detected on the wheel udev before it
+ * has been switched. The wheel is looked up by serial number and then by port
+ * path. Returns -ENOENT if hid-tminit hasn't switched it in the last
+ * identity_ttl_ms. Can be called from atomic context.
+ */
+int tminit_get_identity(struct usb_device *udev, struct tminit_identity *identity);
+
+/*
+ * Asks the wheel udev, switched or not, for its model and attachment again,
+ * e.g. after its rim has been changed, and fills identity. If the wheel has
+ * been switched by hid-tminit, however long ago, its identity is updated and
+ * returned again by tminit_get_identity() for identity_ttl_ms. If the answer
+ * differs a KOBJ_CHANGE uevent with TM_MODEL, TM_ATTACHMENT and TM_NAME is
+ * sent for udev. Sleeps.
+ *
+ * Userspace does the same by writing the serial number or the port path of
+ * the wheel to the rescan_wheel attribute of the hid-thrustmaster driver.
+ */
+int tminit_rescan(struct usb_device *udev, struct tminit_identity *identity);
+
+#endif /* _HID_TMINIT_H */
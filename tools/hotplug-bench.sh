@@ -0,0 +1,177 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0
+#
+# Hot-plugs emulated Thrustmaster wheels on dummy_hcd and reports how long
+# hid-tminit takes to switch them. Each wheel is a configfs gadget whose only
+# function is FunctionFS driven by tm-gadget. All the wheels of a round are
+# connected at once.
+#
+# Reported for every round, as min/p50/p90/p99/max in microseconds:
+# - connect: from the connection of the wheel to the change request, as seen
+#   by tm-gadget
+# - init: TM_INIT_USEC of the uevent of hid-tminit, from its probe to the end
+#   of the switch
+# and how many wheels have been switched per second.
+#
+# Needs root, dummy_hcd, libcomposite, usb_f_fs, udevadm and hid-tminit, either
+# loaded or built in the directory above. Build tm-gadget first with
+# "make tools".
+#
+# Usage: hotplug-bench.sh [-n wheels] [-r rounds] [-m model] [-t timeout_s]
+# model is one of those of tm-gadget, t300 by default.
+
+set -eu
+
+wheels=8
+rounds=5
+model=t300
+timeout=10
+
+while getopts n:r:m:t: opt; do
+	case $opt in
+	n) wheels=$OPTARG ;;
+	r) rounds=$OPTARG ;;
+	m) model=$OPTARG ;;
+	t) timeout=$OPTARG ;;
+	*) sed -n 's/^# Usage: //p' "$0" >&2; exit 2 ;;
+	esac
+done
+
+tools=$(dirname "$(readlink -f "$0")")
+gadget_bin=$tools/tm-gadget
+configfs=/sys/kernel/config/usb_gadget
+work=$(mktemp -d /tmp/tm-bench.XXXXXX)
+monitor_pid=
+
+[ -x "$gadget_bin" ] || { echo "$gadget_bin is missing, run make tools" >&2; exit 1; }
+
+# dummy_hcd has at most 32 UDCs
+[ "$wheels" -ge 1 ] && [ "$wheels" -le 32 ] || { echo "between 1 and 32 wheels" >&2; exit 2; }
+
+modprobe dummy_hcd num="$wheels"
+modprobe libcomposite
+modprobe usb_f_fs
+if ! grep -q '^hid_tminit ' /proc/modules; then
+	if [ -f "$tools/../hid-tminit.ko" ]; then
+		insmod "$tools/../hid-tminit.ko"
+	else
+		modprobe hid-tminit
+	fi
+fi
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+
+cleanup() {
+	[ -n "$monitor_pid" ] && kill "$monitor_pid" 2>/dev/null || true
+	for pid in "$work"/*.pid; do
+		[ -f "$pid" ] && kill "$(cat "$pid")" 2>/dev/null || true
+	done
+	for i in $(seq 0 $((wheels - 1))); do
+		g=$configfs/tmemu$i
+		[ -d "$g" ] || continue
+		echo "" > "$g/UDC" 2>/dev/null || true
+		rm -f "$g/configs/c.1/ffs.tmemu$i"
+		umount "$work/ffs$i" 2>/dev/null || true
+		rmdir "$g/configs/c.1/strings/0x409" "$g/configs/c.1" \
+		      "$g/functions/ffs.tmemu$i" "$g/strings/0x409" "$g" 2>/dev/null || true
+	done
+	rm -rf "$work"
+}
+trap cleanup EXIT INT TERM
+
+udcs=$(ls /sys/class/udc | grep '^dummy_udc' | head -n "$wheels")
+[ "$(echo "$udcs" | wc -l)" -eq "$wheels" ] || { echo "not enough dummy_udc" >&2; exit 1; }
+
+for i in $(seq 0 $((wheels - 1))); do
+	g=$configfs/tmemu$i
+	mkdir "$g"
+	echo 0x044f > "$g/idVendor"
+	echo 0xb65d > "$g/idProduct"
+	mkdir "$g/strings/0x409"
+	echo "Thrustmaster" > "$g/strings/0x409/manufacturer"
+	echo "Thrustmaster FFB Wheel" > "$g/strings/0x409/product"
+	printf "TMEMU%04d\n" "$i" > "$g/strings/0x409/serialnumber"
+	mkdir "$g/configs/c.1" "$g/configs/c.1/strings/0x409"
+	echo "Generic mode" > "$g/configs/c.1/strings/0x409/configuration"
+	mkdir "$g/functions/ffs.tmemu$i"
+	ln -s "$g/functions/ffs.tmemu$i" "$g/configs/c.1/"
+	mkdir "$work/ffs$i"
+	mount -t functionfs "tmemu$i" "$work/ffs$i"
+done
+
+# Nearest rank percentiles of the numbers on stdin
+percentiles() {
+	sort -n | awk '
+		function pct(p,  i) { i = int(p * NR + 0.999999); return v[i < 1 ? 1 : i] }
+		{ v[NR] = $1 }
+		END {
+			if (!NR) { print "no samples"; exit }
+			printf "n=%d min=%d p50=%d p90=%d p99=%d max=%d\n",
+			       NR, v[1], pct(0.5), pct(0.9), pct(0.99), v[NR]
+		}'
+}
+
+now_usec() {
+	echo $(( $(date +%s%N) / 1000 ))
+}
+
+for round in $(seq 1 "$rounds"); do
+	rm -f "$work"/*.out "$work"/*.pid
+	udevadm monitor --kernel --property --subsystem-match=hid > "$work/uevents" &
+	monitor_pid=$!
+
+	# The descriptors have to be written before binding the gadgets
+	for i in $(seq 0 $((wheels - 1))); do
+		"$gadget_bin" "$work/ffs$i" "$model" > "$work/$i.out" &
+		echo $! > "$work/$i.pid"
+	done
+	for i in $(seq 0 $((wheels - 1))); do
+		until grep -q ready "$work/$i.out"; do
+			kill -0 "$(cat "$work/$i.pid")" 2>/dev/null || { echo "tm-gadget $i failed" >&2; exit 1; }
+			sleep 0.01
+		done
+	done
+	sleep 0.2
+
+	start=$(now_usec)
+	i=0
+	for udc in $udcs; do
+		echo "$udc" > "$configfs/tmemu$i/UDC"
+		i=$((i + 1))
+	done
+
+	# Each tm-gadget exits once its wheel has been switched
+	deadline=$(( $(date +%s) + timeout ))
+	while [ "$(date +%s)" -lt "$deadline" ]; do
+		alive=0
+		for pid in "$work"/*.pid; do
+			if kill -0 "$(cat "$pid")" 2>/dev/null; then
+				alive=$((alive + 1))
+			fi
+		done
+		[ "$alive" -eq 0 ] && break
+		sleep 0.01
+	done
+	end=$(now_usec)
+
+	for pid in "$work"/*.pid; do
+		kill "$(cat "$pid")" 2>/dev/null || true
+		wait "$(cat "$pid")" 2>/dev/null || true
+	done
+	for i in $(seq 0 $((wheels - 1))); do
+		echo "" > "$configfs/tmemu$i/UDC" 2>/dev/null || true
+	done
+	# Leaves time to the uevents of the wheels leaving
+	sleep 0.5
+	kill "$monitor_pid" 2>/dev/null || true
+	wait "$monitor_pid" 2>/dev/null || true
+	monitor_pid=
+
+	switched=$(cat "$work"/*.out | grep -c '^switched' || true)
+	failed=$(grep -c '^TM_INIT_RESULT=failed' "$work/uevents" || true)
+	echo "round $round: $switched/$wheels switched, $failed failed in $(( (end - start) / 1000 )) ms," \
+	     "$(awk -v n="$switched" -v us=$((end - start)) 'BEGIN { printf "%.1f", us ? n * 1000000 / us : 0 }') wheels/s"
+	printf "  connect: "
+	cat "$work"/*.out | sed -n 's/.*connect_usec=\([0-9]*\).*/\1/p' | percentiles
+	printf "  init:    "
+	sed -n 's/^TM_INIT_USEC=//p' "$work/uevents" | percentiles
+done
@@ -0,0 +1,362 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Emulates a Thrustmaster wheel in generic mode through FunctionFS, to run
+ * hid-tminit without real wheels, e.g. on dummy_hcd. See hotplug-bench.sh.
+ *
+ * The gadget is a HID joystick with an interrupt in and an interrupt out
+ * endpoint, like the "Thrustmaster FFB Wheel". It answers the model request
+ * with one of the responses of the table in README.md and, when it gets the
+ * change request, prints how long it took from the connection and exits: the
+ * FunctionFS instance is then unbound, the wheel leaves the bus as a real one
+ * does when switched.
+ *
+ * Usage: tm-gadget <functionfs mount point> <model>
+ */
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/usb/ch9.h>
+#include <linux/usb/functionfs.h>
+
+#define TM_MODEL_REQUEST 73
+#define TM_CHANGE_REQUEST 83
+#define HID_DT_HID 0x21
+#define HID_DT_REPORT 0x22
+#define HID_REQ_GET_REPORT 0x01
+
+// The descriptors are little endian, glibc's htole*() can't be used in initializers
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define cpu_to_le16(x) (x)
+#define cpu_to_le32(x) (x)
+#else
+#define cpu_to_le16(x) __builtin_bswap16(x)
+#define cpu_to_le32(x) __builtin_bswap32(x)
+#endif
+
+/*
+ * Answers to the model request, as sent on the wire. See the table in
+ * README.md.
+ */
+static const struct {
+	const char *name;
+	uint8_t response[16];
+	unsigned int length;
+} tm_models[] = {
+	{ "t150", { 0x49, 0x00, 0x21, 0x00, 0x00, 0x00, 0x06, 0x03 }, 16 },
+	{ "t300", { 0x49, 0x00, 0x03, 0x01, 0x01, 0x00, 0x06, 0x02,
+		    0x13, 0x00, 0x00, 0x00, 0x05, 0x01, 0x00, 0x00 }, 16 },
+	{ "t300-gitlab", { 0x49, 0x00, 0x21, 0x00, 0x00, 0x00, 0x06, 0x02 }, 16 },
+	{ "alcantara", { 0x49, 0x00, 0x02, 0x00, 0x01, 0x00, 0x04, 0x02,
+			 0x13, 0x00, 0x00, 0x00, 0x05, 0x01, 0x00, 0x00 }, 16 },
+	{ "tmx", { 0x47, 0x00, 0x41, 0x00, 0x00, 0x00, 0x07, 0x04 }, 8 },
+	{ "t500", { 0x47, 0x00, 0x03, 0x00, 0x00, 0x00, 0x02, 0x00 }, 8 },
+};
+
+/*
+ * Wheel, two pedals, hat switch and 13 buttons, 9 bytes per input report
+ */
+static const uint8_t report_desc[] = {
+	0x05, 0x01,			// Usage Page (Generic Desktop)
+	0x09, 0x04,			// Usage (Joystick)
+	0xa1, 0x01,			// Collection (Application)
+	0x09, 0x30,			//   Usage (X)
+	0x09, 0x31,			//   Usage (Y)
+	0x09, 0x35,			//   Usage (Rz)
+	0x15, 0x00,			//   Logical Minimum (0)
+	0x27, 0xff, 0xff, 0x00, 0x00,	//   Logical Maximum (65535)
+	0x75, 0x10,			//   Report Size (16)
+	0x95, 0x03,			//   Report Count (3)
+	0x81, 0x02,			//   Input (Data, Variable, Absolute)
+	0x09, 0x39,			//   Usage (Hat switch)
+	0x15, 0x00,			//   Logical Minimum (0)
+	0x25, 0x07,			//   Logical Maximum (7)
+	0x75, 0x04,			//   Report Size (4)
+	0x95, 0x01,			//   Report Count (1)
+	0x81, 0x42,			//   Input (Data, Variable, Absolute, Null State)
+	0x81, 0x03,			//   Input (Constant)
+	0x05, 0x09,			//   Usage Page (Button)
+	0x19, 0x01,			//   Usage Minimum (1)
+	0x29, 0x0d,			//   Usage Maximum (13)
+	0x25, 0x01,			//   Logical Maximum (1)
+	0x75, 0x01,			//   Report Size (1)
+	0x95, 0x0d,			//   Report Count (13)
+	0x81, 0x02,			//   Input (Data, Variable, Absolute)
+	0x75, 0x03,			//   Report Size (3)
+	0x95, 0x01,			//   Report Count (1)
+	0x81, 0x03,			//   Input (Constant)
+	0xc0,				// End Collection
+};
+
+struct hid_desc {
+	uint8_t bLength;
+	uint8_t bDescriptorType;
+	uint16_t bcdHID;
+	uint8_t bCountryCode;
+	uint8_t bNumDescriptors;
+	uint8_t bReportType;
+	uint16_t wReportLength;
+} __attribute__((packed));
+
+struct speed_descs {
+	struct usb_interface_descriptor intf;
+	struct hid_desc hid;
+	struct usb_endpoint_descriptor_no_audio ep_in;
+	struct usb_endpoint_descriptor_no_audio ep_out;
+} __attribute__((packed));
+
+#define SPEED_DESCS(_interval) {						\
+	.intf = {								\
+		.bLength = sizeof(struct usb_interface_descriptor),		\
+		.bDescriptorType = USB_DT_INTERFACE,				\
+		.bNumEndpoints = 2,						\
+		.bInterfaceClass = USB_CLASS_HID,				\
+		.iInterface = 1,						\
+	},									\
+	.hid = {								\
+		.bLength = sizeof(struct hid_desc),				\
+		.bDescriptorType = HID_DT_HID,					\
+		.bcdHID = cpu_to_le16(0x0111),					\
+		.bNumDescriptors = 1,						\
+		.bReportType = HID_DT_REPORT,					\
+		.wReportLength = cpu_to_le16(sizeof(report_desc)),		\
+	},									\
+	.ep_in = {								\
+		.bLength = USB_DT_ENDPOINT_SIZE,				\
+		.bDescriptorType = USB_DT_ENDPOINT,				\
+		.bEndpointAddress = 1 | USB_DIR_IN,				\
+		.bmAttributes = USB_ENDPOINT_XFER_INT,				\
+		.wMaxPacketSize = cpu_to_le16(64),				\
+		.bInterval = (_interval),					\
+	},									\
+	/* endpoint[1] of the interface, used by hid-tminit for the setup */	\
+	.ep_out = {								\
+		.bLength = USB_DT_ENDPOINT_SIZE,				\
+		.bDescriptorType = USB_DT_ENDPOINT,				\
+		.bEndpointAddress = 2 | USB_DIR_OUT,				\
+		.bmAttributes = USB_ENDPOINT_XFER_INT,				\
+		.wMaxPacketSize = cpu_to_le16(64),				\
+		.bInterval = (_interval),					\
+	},									\
+}
+
+static const struct {
+	struct usb_functionfs_descs_head_v2 header;
+	uint32_t fs_count;
+	uint32_t hs_count;
+	struct speed_descs fs;
+	struct speed_descs hs;
+} __attribute__((packed)) descriptors = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+		.flags = cpu_to_le32(FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC),
+		.length = cpu_to_le32(sizeof(descriptors)),
+	},
+	.fs_count = cpu_to_le32(4),
+	.hs_count = cpu_to_le32(4),
+	// Every 1 ms at both speeds
+	.fs = SPEED_DESCS(1),
+	.hs = SPEED_DESCS(4),
+};
+
+#define INTERFACE_NAME "Thrustmaster FFB Wheel"
+
+static const struct {
+	struct usb_functionfs_strings_head header;
+	struct {
+		uint16_t code;
+		char str[sizeof(INTERFACE_NAME)];
+	} __attribute__((packed)) lang;
+} __attribute__((packed)) strings = {
+	.header = {
+		.magic = cpu_to_le32(FUNCTIONFS_STRINGS_MAGIC),
+		.length = cpu_to_le32(sizeof(strings)),
+		.str_count = cpu_to_le32(1),
+		.lang_count = cpu_to_le32(1),
+	},
+	.lang = { cpu_to_le16(0x0409), INTERFACE_NAME },
+};
+
+// Setup interrupts received on the out endpoint
+static volatile unsigned int setup_count;
+
+static int64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Drains the out endpoint, where hid-tminit sends the setup interrupts
+static void *out_thread(void *path)
+{
+	uint8_t buf[64];
+	int fd = open(path, O_RDONLY);
+	ssize_t ret;
+
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	for (;;) {
+		ret = read(fd, buf, sizeof(buf));
+		if (ret > 0)
+			setup_count++;
+		// Once disabled the next read waits for the endpoint to be enabled again
+		else if (ret < 0 && errno != ESHUTDOWN && errno != EINTR)
+			break;
+	}
+
+	close(fd);
+	return NULL;
+}
+
+// Accepts the data stage of a request from the host, or acknowledges it
+static void ep0_ack(int ep0, const struct usb_ctrlrequest *setup)
+{
+	uint8_t buf[256];
+	size_t length = le16toh(setup->wLength);
+
+	if (read(ep0, buf, length < sizeof(buf) ? length : sizeof(buf)) < 0)
+		perror("ep0 ack");
+}
+
+static void ep0_reply(int ep0, const struct usb_ctrlrequest *setup, const void *data, size_t length)
+{
+	if (length > le16toh(setup->wLength))
+		length = le16toh(setup->wLength);
+	if (write(ep0, data, length) < 0)
+		perror("ep0 reply");
+}
+
+// A read on an in request, or a write on an out one, stalls it
+static void ep0_stall(int ep0, const struct usb_ctrlrequest *setup)
+{
+	uint8_t dummy = 0;
+	ssize_t ret;
+
+	if (setup->bRequestType & USB_DIR_IN)
+		ret = read(ep0, &dummy, 0);
+	else
+		ret = write(ep0, &dummy, 0);
+	if (ret >= 0 || errno != EL2HLT)
+		fprintf(stderr, "stall of request 0x%02x/%u failed\n", setup->bRequestType, setup->bRequest);
+}
+
+int main(int argc, char **argv)
+{
+	static const uint8_t zeros[64];
+	struct usb_functionfs_event events[4];
+	const struct usb_ctrlrequest *setup;
+	unsigned int model, queries = 0, i;
+	int64_t bind_usec = 0;
+	pthread_t thread;
+	char path[256];
+	ssize_t ret;
+	int ep0;
+
+	if (argc != 3) {
+		fprintf(stderr, "Usage: %s <functionfs mount point> <model>\n", argv[0]);
+		return 2;
+	}
+
+	for (model = 0; model < sizeof(tm_models) / sizeof(tm_models[0]); model++)
+		if (!strcmp(tm_models[model].name, argv[2]))
+			break;
+	if (model == sizeof(tm_models) / sizeof(tm_models[0])) {
+		fprintf(stderr, "Unknown model %s, one of:", argv[2]);
+		for (i = 0; i < sizeof(tm_models) / sizeof(tm_models[0]); i++)
+			fprintf(stderr, " %s", tm_models[i].name);
+		fprintf(stderr, "\n");
+		return 2;
+	}
+
+	snprintf(path, sizeof(path), "%s/ep0", argv[1]);
+	ep0 = open(path, O_RDWR);
+	if (ep0 < 0) {
+		perror(path);
+		return 1;
+	}
+	if (write(ep0, &descriptors, sizeof(descriptors)) < 0 ||
+	    write(ep0, &strings, sizeof(strings)) < 0) {
+		perror("writing the descriptors");
+		return 1;
+	}
+
+	// ep1 is the in endpoint, only read by usbhid when the device is open
+	snprintf(path, sizeof(path), "%s/ep2", argv[1]);
+	if (pthread_create(&thread, NULL, out_thread, path)) {
+		fprintf(stderr, "cannot start the thread of the out endpoint\n");
+		return 1;
+	}
+
+	// The gadget can be bound to the UDC from now on
+	printf("ready\n");
+	fflush(stdout);
+
+	for (;;) {
+		ret = read(ep0, events, sizeof(events));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("ep0");
+			return 1;
+		}
+
+		for (i = 0; i < ret / sizeof(events[0]); i++) {
+			if (events[i].type == FUNCTIONFS_BIND)
+				bind_usec = now_usec();
+			if (events[i].type != FUNCTIONFS_SETUP)
+				continue;
+
+			setup = &events[i].u.setup;
+			switch (setup->bRequestType & USB_TYPE_MASK) {
+			case USB_TYPE_STANDARD:
+				if (setup->bRequest == USB_REQ_GET_DESCRIPTOR &&
+				    le16toh(setup->wValue) >> 8 == HID_DT_REPORT)
+					ep0_reply(ep0, setup, report_desc, sizeof(report_desc));
+				else
+					ep0_stall(ep0, setup);
+				break;
+			case USB_TYPE_CLASS:
+				// SET_IDLE and the like are accepted, GET_REPORT gets an idle wheel
+				if (!(setup->bRequestType & USB_DIR_IN))
+					ep0_ack(ep0, setup);
+				else if (setup->bRequest == HID_REQ_GET_REPORT)
+					ep0_reply(ep0, setup, zeros, sizeof(zeros));
+				else
+					ep0_stall(ep0, setup);
+				break;
+			case USB_TYPE_VENDOR:
+				if (setup->bRequestType == (USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE) &&
+				    setup->bRequest == TM_MODEL_REQUEST) {
+					queries++;
+					ep0_reply(ep0, setup, tm_models[model].response, tm_models[model].length);
+				} else if (setup->bRequestType == (USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_INTERFACE) &&
+					   setup->bRequest == TM_CHANGE_REQUEST) {
+					ep0_ack(ep0, setup);
+					printf("switched value=0x%04x connect_usec=%lld queries=%u setup=%u\n",
+					       le16toh(setup->wValue), (long long)(now_usec() - bind_usec),
+					       queries, setup_count);
+					fflush(stdout);
+					// Closing ep0 unbinds the gadget, the wheel leaves
+					return 0;
+				} else {
+					ep0_stall(ep0, setup);
+				}
+				break;
+			default:
+				ep0_stall(ep0, setup);
+			}
+		}
+	}
+}